@@ -1,517 +1,3888 @@
+/* posix_memalign is POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "tree.h"
+#include "typed_tree.h"
+
+/* Upper bound on the height of a turbo (AVL) tree. An AVL tree with n nodes
+ * is at most 1.44 * log2(n + 2) high, so 64 levels covers any tree that fits
+ * in memory. */
+#define TREE_MAX_HEIGHT 64
+
+/* Number of times a lock-free lookup is tried before it takes the lock. */
+#define CONCURRENT_RETRIES 16
+
+/* Number of steps a lock-free lookup takes between checks of the version. */
+#define CONCURRENT_CHECK 64
+
+/* Store a key or child pointer that concurrent_find may load at the same
+ * time. A relaxed atomic store is a plain move on common processors, so the
+ * trees that are not concurrent pay nothing for it. */
+#define SHARED_STORE(field, value)                                            \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+/* Keys per B-tree node. The keys fill exactly one cache line, so searching a
+ * node touches one line and takes four SSE2 (or two AVX2) compares. */
+#define BTREE_KEYS 16
+
+/* Minimum number of keys in every B-tree node except the root. */
+#define BTREE_MIN (BTREE_KEYS / 2)
+
+/* Number of lookups that tree_find_many walks down the tree side by side. */
+#define FIND_GROUP 16
+
+/* Minimum number of nodes in the two halves of a set operation before one
+ * half gets its own thread. */
+#define SET_PARALLEL_CUTOFF 20000
+
+/* Number of nodes a change of a tree with snapshots may copy: the path down
+ * and the nodes that a rotation on every level of it touches. */
+#define SNAPSHOT_RESERVE (3 * TREE_MAX_HEIGHT + 2)
+
+/* Number of nodes carved from one slab of the node arena. */
+#define SLAB_NODES 4096
+
+/* Operations counted by tree_stats. */
+#define STAT_FIND 0
+#define STAT_INSERT 1
+#define STAT_REMOVE 2
+
+/* Compile with -DTREE_STATS to count the work of every tree for tree_stats.
+ * Without it the counters do not exist and the macros compile to nothing. */
+#ifdef TREE_STATS
+#define STAT_VISIT(tree, n) ((tree)->counters.visited += (n))
+#define STAT_RESTRUCTURE(tree, n) ((tree)->counters.restructures += (n))
+#define STAT_START(tree) ((tree)->counters.start = (tree)->counters.visited)
+#define STAT_STOP(tree, op)                                                   \
+    ((tree)->counters.ops[op]++,                                              \
+     (tree)->counters.visits[op] +=                                           \
+     (tree)->counters.visited - (tree)->counters.start)
+#else
+#define STAT_VISIT(tree, n) ((void)(tree), (void)(n))
+#define STAT_RESTRUCTURE(tree, n) ((void)(tree), (void)(n))
+#define STAT_START(tree) ((void)(tree))
+#define STAT_STOP(tree, op) ((void)(tree))
+#endif
+
+/**
+ * Work counters of a tree, kept with TREE_STATS.
+ * @param visited nodes visited by all operations together
+ * @param start value of visited when the current operation started
+ * @param ops number of finds, inserts and removes
+ * @param visits nodes visited by the finds, inserts and removes
+ * @param restructures rotations of binary trees, splits, borrows and merges
+ * of B-tree nodes
+ */
+struct tree_counters
+{
+    unsigned long visited;
+    unsigned long start;
+    unsigned long ops[3];
+    unsigned long visits[3];
+    unsigned long restructures;
+};
 
 /**
  * Binary search tree.
  * @param root the root of the tree
+ * @param turbo the kind of tree: TREE_PLAIN, TREE_AVL, TREE_BTREE or
+ * TREE_SPLAY
+ * @param btree the root of a TREE_BTREE tree, which does not use root
+ * @param slabs list of slabs the nodes of this tree are carved from
+ * @param slab_used number of nodes handed out from the first slab
+ * @param free_list removed nodes that can be reused, linked through lhs
+ * @param concurrent 1 if the tree was made with TREE_CONCURRENT
+ * @param lock serializes the writers of a concurrent tree
+ * @param version odd while a writer changes a concurrent tree, it goes up
+ * by two for every change
+ * @param origin the tree a snapshot was taken from, NULL if this is not a
+ * snapshot
+ * @param generation new nodes get this generation, a snapshot keeps the
+ * generation of the tree at the moment it was taken
+ * @param shared generation of the newest snapshot or 0 if there is none,
+ * nodes up to this generation may be seen by snapshots
+ * @param first_snapshot the oldest snapshot of the tree
+ * @param last_snapshot the newest snapshot of the tree
+ * @param prev_snapshot the next older snapshot of the same tree
+ * @param next_snapshot the next newer snapshot of the same tree
+ * @param retired nodes that left the tree while snapshots may use them
+ * @param retired_count number of retired nodes
+ * @param retired_size room in retired
+ * @param closed 1 if tree_cleanup was called while snapshots were left
+ * @param counters work counters for tree_stats, only with TREE_STATS
  */
 struct tree
 {
     struct node *root;
+    int turbo;
+    struct bnode *btree;
+    struct slab *slabs;
+    size_t slab_used;
+    struct node *free_list;
+    int concurrent;
+    pthread_mutex_t lock;
+    unsigned long version;
+    struct tree *origin;
+    unsigned long generation;
+    unsigned long shared;
+    struct tree *first_snapshot;
+    struct tree *last_snapshot;
+    struct tree *prev_snapshot;
+    struct tree *next_snapshot;
+    struct retired *retired;
+    size_t retired_count;
+    size_t retired_size;
+    int closed;
+#ifdef TREE_STATS
+    struct tree_counters counters;
+#endif
 };
 
 /**
- * Node that contains the data,left child and right child.
+ * Node that contains the data, height of the subtree, number of nodes in the
+ * subtree, the generation of the tree it was made in, left child and right
+ * child. The height is only maintained in turbo (AVL) trees.
  */
 struct node
 {
     int data;
+    int height;
+    size_t size;
+    unsigned long gen;
     struct node *lhs;
     struct node *rhs;
 };
 typedef struct node node;
 
-/* Unique id's for numbering nodes in dot format. */
-static int global_node_counter = 0;
+/**
+ * Node that left a tree while snapshots may still use it.
+ * @param n the node
+ * @param generation generation of the tree when the node left it, only
+ * snapshots older than that can see it
+ */
+struct retired
+{
+    node *n;
+    unsigned long generation;
+};
+
+/**
+ * Node of a TREE_BTREE tree, which is a B+-tree. The keys are stored in the
+ * leaves, inner nodes only route the search: child[i] holds the keys from
+ * keys[i - 1] up to but not including keys[i]. Every node links to its right
+ * neighbour on the same level, so the leaves form a sorted list for range
+ * scans. A node is four cache lines, the keys fill the first one.
+ * @param keys sorted keys, unused slots hold INT_MAX
+ * @param count number of keys in use
+ * @param leaf 1 if the node is a leaf
+ * @param total number of keys in the leaves below this node
+ * @param next right neighbour on the same level or NULL
+ * @param child children of an inner node
+ */
+struct bnode
+{
+    int keys[BTREE_KEYS];
+    int count;
+    int leaf;
+    size_t total;
+    struct bnode *next;
+    struct bnode *child[BTREE_KEYS + 1];
+} __attribute__((aligned(64)));
+
+/**
+ * Slab of nodes owned by a single tree.
+ * @param next the previously allocated slab
+ * @param size number of nodes in the slab
+ * @param nodes the nodes
+ */
+struct slab
+{
+    struct slab *next;
+    size_t size;
+    struct node nodes[];
+};
+
+/**
+ * Immutable copy of the keys of a tree, laid out as an implicit binary tree
+ * in Eytzinger (breadth-first) order: keys[k] has its children at keys[2k]
+ * and keys[2k + 1], keys[0] is unused. The array is cache line aligned, so
+ * the 16 descendants four levels below a key share one cache line.
+ * @param keys the keys, keys[1] is the root
+ * @param size number of keys
+ * @param map the mapped file if the keys are read from a file, else NULL
+ * @param map_size size of the mapped file
+ */
+struct frozen_tree
+{
+    int *keys;
+    size_t size;
+    void *map;
+    size_t map_size;
+};
+
+/* Magic bytes at the start of a file written by tree_save. */
+#define TREE_FILE_MAGIC "BSTREE\r\n"
+
+/* Version of the file format written by tree_save. */
+#define TREE_FILE_VERSION 1
+
+/**
+ * Header of a file written by tree_save. It is followed by the keys in
+ * Eytzinger order, like the keys of a frozen tree: slot 0 is unused and
+ * slots 1 up to and including size hold the keys. The header is one cache
+ * line, so a mapped file keeps the keys cache line aligned.
+ * @param magic TREE_FILE_MAGIC
+ * @param version TREE_FILE_VERSION
+ * @param byte_order 0x01020304 as written by the machine that saved it
+ * @param key_size sizeof(int) of the machine that saved it
+ * @param turbo the kind of the saved tree
+ * @param size number of keys
+ */
+struct tree_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size;
+    uint32_t turbo;
+    uint64_t size;
+    char unused[32];
+};
+
+/**
+ * Cursor that walks the items of a tree in sorted order. The nodes that
+ * still have to be visited are kept on a heap allocated stack, so the walk
+ * needs no recursion, also not on degenerate trees.
+ * @param tree the tree that is walked
+ * @param stack nodes whose data and right subtree are not visited yet
+ * @param top number of nodes on the stack
+ * @param stack_size capacity of the stack
+ * @param leaf current leaf of a TREE_BTREE tree
+ * @param pos position of the next key in leaf
+ */
+struct tree_iter
+{
+    struct tree *tree;
+    struct node **stack;
+    size_t top;
+    size_t stack_size;
+    struct bnode *leaf;
+    int pos;
+};
 
-/* Helper function: Allocate a new tree node and initialise it with
- * the given parameters. Return a pointer to the new node or NULL on
+/* Helper function: Add a slab with room for size nodes to the arena of the
+ * tree, new nodes are carved from it first. Return 0 if successful and -1 on
  * failure. */
-static node *make_node(int data)
+static int add_slab(struct tree *tree, size_t size)
 {
-    //! if malloc failed return NULL
-    struct node *new_node = malloc(sizeof(struct node));
-    if (new_node == NULL)
+    struct slab *slab = malloc(sizeof(struct slab) + size * sizeof(struct node));
+    if (slab == NULL)
     {
-        return NULL;
+        return -1;
+    }
+    slab->size = size;
+    slab->next = tree->slabs;
+    tree->slabs = slab;
+    tree->slab_used = 0;
+    return 0;
+}
+
+/* Helper function: Allocate a new tree node from the arena of the tree and
+ * initialise it with the given parameters. Return a pointer to the new node
+ * or NULL on failure. */
+static node *make_node(struct tree *tree, int data)
+{
+    struct node *new_node;
+    //! reuse a removed node if there is one
+    if (tree->free_list != NULL)
+    {
+        new_node = tree->free_list;
+        tree->free_list = new_node->lhs;
+    }
+    else
+    {
+        //! start a new slab if the current one is used up
+        if (tree->slabs == NULL || tree->slab_used == tree->slabs->size)
+        {
+            //! if malloc failed return NULL
+            if (add_slab(tree, SLAB_NODES) != 0)
+            {
+                return NULL;
+            }
+        }
+        new_node = &tree->slabs->nodes[tree->slab_used++];
     }
-    new_node->data = data;
-    new_node->lhs = NULL;
-    new_node->rhs = NULL;
+    //! a reader of a concurrent tree may still be on a reused node
+    SHARED_STORE(new_node->data, data);
+    new_node->height = 1;
+    new_node->size = 1;
+    new_node->gen = tree->generation;
+    SHARED_STORE(new_node->lhs, (node *)NULL);
+    SHARED_STORE(new_node->rhs, (node *)NULL);
     return new_node;
 }
 
-static int print_tree_dot_r(node *root, FILE *dotf)
+/* Helper function: Give a node that is no longer in the tree back to the
+ * arena of the tree. */
+static void free_node(struct tree *tree, node *n)
 {
-    int left_id, right_id, my_id = global_node_counter++;
+    SHARED_STORE(n->lhs, tree->free_list);
+    tree->free_list = n;
+}
 
-    if (root == NULL)
+/* Helper function: Make sure that the next count nodes can be made without
+ * malloc, so a change of a tree with snapshots can not fail halfway. The
+ * rest of a slab that is too small goes to the free list. Return 0 if
+ * successful and -1 on failure. */
+static int reserve_nodes(struct tree *tree, size_t count)
+{
+    if (tree->slabs != NULL && tree->slabs->size - tree->slab_used >= count)
+    {
+        return 0;
+    }
+    if (tree->slabs != NULL)
+    {
+        while (tree->slab_used < tree->slabs->size)
+        {
+            free_node(tree, &tree->slabs->nodes[tree->slab_used++]);
+        }
+    }
+    return add_slab(tree, SLAB_NODES);
+}
+
+/* Helper function: Give a node that left the tree back to the arena, or keep
+ * it for the snapshots that may still see it. If the list of retired nodes
+ * can not grow, the node stays unused until the tree is freed. */
+static void retire_node(struct tree *tree, node *n)
+{
+    if (n->gen > tree->shared)
+    {
+        free_node(tree, n);
+        return;
+    }
+    if (tree->retired_count == tree->retired_size)
+    {
+        size_t size = tree->retired_size == 0 ? 64 : 2 * tree->retired_size;
+        struct retired *retired =
+            realloc(tree->retired, size * sizeof(struct retired));
+        if (retired == NULL)
+        {
+            return;
+        }
+        tree->retired = retired;
+        tree->retired_size = size;
+    }
+    tree->retired[tree->retired_count].n = n;
+    tree->retired[tree->retired_count].generation = tree->generation;
+    tree->retired_count++;
+}
+
+/* Helper function: Give the retired nodes that no snapshot can see anymore
+ * back to the arena. */
+static void reclaim_nodes(struct tree *tree)
+{
+    unsigned long oldest = tree->first_snapshot != NULL
+                               ? tree->first_snapshot->generation
+                               : ULONG_MAX;
+    size_t kept = 0;
+    for (size_t i = 0; i < tree->retired_count; i++)
+    {
+        if (tree->retired[i].generation <= oldest)
+        {
+            free_node(tree, tree->retired[i].n);
+        }
+        else
+        {
+            tree->retired[kept++] = tree->retired[i];
+        }
+    }
+    tree->retired_count = kept;
+}
+
+/**
+ * This function makes sure that the node at *link is not seen by a snapshot
+ * before it is changed. A shared node is copied, the copy takes its place in
+ * the tree and the original is retired. Nodes must have been reserved.
+ *
+ * @param tree the tree
+ * @param link pointer to the child pointer that holds the node
+ * @return the node at *link, which may be changed now
+ */
+static node *own_node(struct tree *tree, node **link)
+{
+    node *n = *link;
+    if (n == NULL || n->gen > tree->shared)
     {
-        fprintf(dotf, "    %d [shape=point];\n", my_id);
-        return my_id;
+        return n;
     }
+    node *copy = make_node(tree, n->data);
+    copy->height = n->height;
+    copy->size = n->size;
+    SHARED_STORE(copy->lhs, n->lhs);
+    SHARED_STORE(copy->rhs, n->rhs);
+    SHARED_STORE(*link, copy);
+    retire_node(tree, n);
+    return copy;
+}
 
-    fprintf(dotf, "    %d [color=%s label=\"%d\"]\n", my_id, "black", root->data);
+/* Helper function: Return the height of the subtree, 0 for an empty one. */
+static int node_height(node *n)
+{
+    return n == NULL ? 0 : n->height;
+}
 
-    left_id = print_tree_dot_r(root->lhs, dotf);
-    fprintf(dotf, "    %d -> %d [label=\"l\"]\n", my_id, left_id);
+/* Helper function: Return the number of nodes in the subtree. */
+static size_t node_size(node *n)
+{
+    return n == NULL ? 0 : n->size;
+}
 
-    right_id = print_tree_dot_r(root->rhs, dotf);
-    fprintf(dotf, "    %d -> %d [label=\"r\"]\n", my_id, right_id);
+/* Helper function: Recompute the height and size of a node from its
+ * children. */
+static void node_update(node *n)
+{
+    int lhs = node_height(n->lhs);
+    int rhs = node_height(n->rhs);
+    n->height = (lhs > rhs ? lhs : rhs) + 1;
+    n->size = node_size(n->lhs) + node_size(n->rhs) + 1;
+}
 
-    return my_id;
+/**
+ * This function rotates the subtree at *link to the left, the right child
+ * becomes the new root of the subtree.
+ *
+ * @param link pointer to the child pointer that holds the subtree
+ */
+static void rotate_left(node **link)
+{
+    node *tmp = *link;
+    node *child = tmp->rhs;
+    SHARED_STORE(tmp->rhs, child->lhs);
+    SHARED_STORE(child->lhs, tmp);
+    node_update(tmp);
+    node_update(child);
+    SHARED_STORE(*link, child);
 }
 
-void tree_dot(struct tree *tree, char *filename)
+/**
+ * This function rotates the subtree at *link to the right, the left child
+ * becomes the new root of the subtree.
+ *
+ * @param link pointer to the child pointer that holds the subtree
+ */
+static void rotate_right(node **link)
 {
-    node *root = tree->root;
-    global_node_counter = 0;
-    FILE *dotf = fopen(filename, "w");
-    if (!dotf)
+    node *tmp = *link;
+    node *child = tmp->lhs;
+    SHARED_STORE(tmp->lhs, child->rhs);
+    SHARED_STORE(child->rhs, tmp);
+    node_update(tmp);
+    node_update(child);
+    SHARED_STORE(*link, child);
+}
+
+/**
+ * This function restores the AVL balance of the subtree at *link, assuming
+ * both children are balanced and differ at most two in height.
+ *
+ * @param link pointer to the child pointer that holds the subtree
+ * @return the number of rotations
+ */
+static int rebalance(node **link)
+{
+    node *tmp = *link;
+    int balance = node_height(tmp->lhs) - node_height(tmp->rhs);
+    //! left subtree is too high
+    if (balance > 1)
     {
-        printf("error opening file: %s\n", filename);
-        exit(1);
+        //! left-right case, first turn it into a left-left case
+        if (node_height(tmp->lhs->lhs) < node_height(tmp->lhs->rhs))
+        {
+            rotate_left(&tmp->lhs);
+            rotate_right(link);
+            return 2;
+        }
+        rotate_right(link);
+        return 1;
     }
-    fprintf(dotf, "digraph {\n");
-    if (root)
+    //! right subtree is too high
+    else if (balance < -1)
     {
-        print_tree_dot_r(root, dotf);
+        //! right-left case, first turn it into a right-right case
+        if (node_height(tmp->rhs->rhs) < node_height(tmp->rhs->lhs))
+        {
+            rotate_right(&tmp->rhs);
+            rotate_left(link);
+            return 2;
+        }
+        rotate_left(link);
+        return 1;
     }
-    fprintf(dotf, "}\n");
-    fclose(dotf);
+    node_update(tmp);
+    return 0;
 }
 
 /**
- * This function points to the parent of the node that containst the given data.
+ * This function copies the nodes below tmp that rebalance would rotate, if
+ * snapshots may see them. tmp itself must be owned already.
+ *
+ * @param tree the tree
+ * @param tmp the root of the subtree that is rebalanced
+ */
+static void own_rotation(struct tree *tree, node *tmp)
+{
+    int balance = node_height(tmp->lhs) - node_height(tmp->rhs);
+    if (balance > 1)
+    {
+        node *child = own_node(tree, &tmp->lhs);
+        if (node_height(child->lhs) < node_height(child->rhs))
+        {
+            own_node(tree, &child->rhs);
+        }
+    }
+    else if (balance < -1)
+    {
+        node *child = own_node(tree, &tmp->rhs);
+        if (node_height(child->rhs) < node_height(child->lhs))
+        {
+            own_node(tree, &child->lhs);
+        }
+    }
+}
+
+/**
+ * This function walks back up the recorded search path and rebalances every
+ * subtree on it. It stops as soon as a subtree keeps its old height, because
+ * nothing above it can have changed.
+ *
+ * @param tree the tree, its snapshots keep their nodes
+ * @param path the child pointers visited from the root downwards
+ * @param depth number of entries in path
+ */
+static void rebalance_path(struct tree *tree, node ***path, size_t depth)
+{
+    while (depth > 0)
+    {
+        node **link = path[--depth];
+        int old_height = (*link)->height;
+        own_rotation(tree, *link);
+        int rotations = rebalance(link);
+        STAT_RESTRUCTURE(tree, rotations);
+        if ((*link)->height == old_height)
+        {
+            break;
+        }
+    }
+}
+
+/* The search of plain and turbo trees is the one of typed_tree.h, with the
+ * visited nodes counted. */
+TYPED_TREE_SEARCH(bst_search, struct tree, node, int, data, TREE_CMP_NUMBER,
+                  STAT_VISIT)
+
+/**
+ * This function searches data in a binary tree.
  *
  * @param tree input tree
  * @param data input data
- * @return the parent of the node
+ * @return 1 if the tree contains the data, 0 otherwise
  */
-struct node *previous(struct tree *tree, int data)
+static int bst_find(struct tree *tree, int data)
 {
-    //! begins with the root
-    struct node *tmp = tree->root;
-    while (tmp != NULL)
+    return bst_search(tree, data) != NULL;
+}
+
+/**
+ * Child pointers followed from the root of a binary tree down to a node.
+ * Paths of up to TREE_MAX_HEIGHT links, which covers every turbo tree, use
+ * the room inside the struct, longer paths of plain trees move to the heap.
+ * @param links the child pointers, starting with the one in the tree
+ * @param depth number of child pointers
+ * @param size room in links
+ * @param local the room used first
+ */
+struct path
+{
+    node ***links;
+    size_t depth;
+    size_t size;
+    node **local[TREE_MAX_HEIGHT];
+};
+
+/* Helper function: Start an empty path. */
+static void path_init(struct path *path)
+{
+    path->links = path->local;
+    path->depth = 0;
+    path->size = TREE_MAX_HEIGHT;
+}
+
+/* Helper function: Add a child pointer to the path, the path grows when it
+ * is full. Return 0 if successful and -1 on failure. */
+static int path_push(struct path *path, node **link)
+{
+    if (path->depth == path->size)
     {
-        //! if data is less than the node, search left node
-        if (data < tmp->data)
+        node ***links = malloc(2 * path->size * sizeof(node **));
+        if (links == NULL)
         {
-            //! return the node if the node contains the given data
-            if (tmp->lhs->data == data)
-            {
-                return tmp;
-            }
-            else
-            {
-                tmp = tmp->lhs;
-            }
+            return -1;
         }
-        //! if data is less than the node, search right node
-        else if (data > tmp->data)
+        memcpy(links, path->links, path->depth * sizeof(node **));
+        if (path->links != path->local)
         {
-            //! return the node if the node contains the given data
-            if (tmp->rhs->data == data)
-            {
-                return tmp;
-            }
-            else
-            {
-                tmp = tmp->rhs;
-            }
+            free(path->links);
         }
-        else
-            break;
+        path->links = links;
+        path->size *= 2;
+    }
+    path->links[path->depth++] = link;
+    return 0;
+}
+
+/* Helper function: Free the memory of a path. */
+static void path_cleanup(struct path *path)
+{
+    if (path->links != path->local)
+    {
+        free(path->links);
+    }
+}
+
+/**
+ * This function walks down a plain or turbo tree to data and records every
+ * child pointer it follows. Nodes on the way that snapshots may see are
+ * copied, so the caller can change them.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @param path output, the child pointers above the returned one
+ * @return the child pointer that holds data, or the empty one where data
+ * belongs, NULL on failure
+ */
+static node **descend(struct tree *tree, int data, struct path *path)
+{
+    node **link = &tree->root;
+    while (*link != NULL && (*link)->data != data)
+    {
+        STAT_VISIT(tree, 1);
+        own_node(tree, link);
+        if (path_push(path, link) != 0)
+        {
+            return NULL;
+        }
+        link = data < (*link)->data ? &(*link)->lhs : &(*link)->rhs;
+    }
+    return link;
+}
+
+/**
+ * This function makes room for the copies a change of a tree with snapshots
+ * needs, after checking that the change does something at all: a change
+ * that only finds out that data is or is not there should not copy the
+ * nodes on its way down.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @param present 1 if the change needs data to be in the tree, 0 if not
+ * @return 0 if the change can go ahead, 1 if it does nothing, -1 on failure
+ */
+static int prepare_change(struct tree *tree, int data, int present)
+{
+    if (tree->shared == 0)
+    {
+        return 0;
+    }
+    else if (bst_find(tree, data) != present)
+    {
+        return 1;
+    }
+    return reserve_nodes(tree, SNAPSHOT_RESERVE) == 0 ? 0 : -1;
+}
+
+/**
+ * This function inserts data into a plain or turbo tree in a single pass
+ * down, or finds the node that already holds it. The pass records the way
+ * down, which is walked back up to count the new node in the subtree sizes
+ * and, in a turbo tree, to rebalance.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @param status output, 0 if data was inserted, 1 if data was already
+ * present, -1 on failure
+ * @return the node that holds data, or NULL on failure
+ */
+static node *bst_insert(struct tree *tree, int data, int *status)
+{
+    struct path path;
+    node **link;
+    *status = prepare_change(tree, data, 0);
+    if (*status == 1)
+    {
+        //! without changes the tree can be searched as it is
+        link = &tree->root;
+        while ((*link)->data != data)
+        {
+            link = data < (*link)->data ? &(*link)->lhs : &(*link)->rhs;
+        }
+        return *link;
+    }
+    else if (*status < 0)
+    {
+        return NULL;
+    }
+    path_init(&path);
+    link = descend(tree, data, &path);
+    node *result = NULL;
+    if (link == NULL)
+    {
+        *status = -1;
+    }
+    else if (*link != NULL)
+    {
+        *status = 1;
+        result = *link;
+    }
+    else if ((result = make_node(tree, data)) == NULL)
+    {
+        *status = -1;
+    }
+    else
+    {
+        SHARED_STORE(*link, result);
+        //! every subtree on the way down got one node more
+        for (size_t i = 0; i < path.depth; i++)
+        {
+            (*path.links[i])->size++;
+        }
+        if (tree->turbo == TREE_AVL)
+        {
+            rebalance_path(tree, path.links, path.depth);
+        }
+    }
+    path_cleanup(&path);
+    return result;
+}
+
+/**
+ * This function takes the node at *link out of a plain or turbo tree. A node
+ * with two children is replaced by the most right node of its left subtree.
+ * The path is extended down to that node, and the entry that pointed into
+ * the removed node is moved to the node that took its place.
+ *
+ * @param tree input tree
+ * @param link the child pointer that holds the node
+ * @param path the child pointers above link, extended by this function
+ * @return 0 if successful, -1 on failure, in which case nothing changed
+ */
+static int unlink_node(struct tree *tree, node **link, struct path *path)
+{
+    node *delete = *link;
+    //! node with at most one child is replaced by that child
+    if (delete->lhs == NULL || delete->rhs == NULL)
+    {
+        SHARED_STORE(*link, delete->lhs != NULL ? delete->lhs : delete->rhs);
+        retire_node(tree, delete);
+        return 0;
+    }
+    size_t delete_depth = path->depth;
+    delete = own_node(tree, link);
+    if (path_push(path, link) != 0)
+    {
+        return -1;
+    }
+    node **swap_link = &delete->lhs;
+    while ((*swap_link)->rhs != NULL)
+    {
+        STAT_VISIT(tree, 1);
+        own_node(tree, swap_link);
+        if (path_push(path, swap_link) != 0)
+        {
+            return -1;
+        }
+        swap_link = &(*swap_link)->rhs;
+    }
+    node *swap = own_node(tree, swap_link);
+    SHARED_STORE(*swap_link, swap->lhs);
+    SHARED_STORE(swap->lhs, delete->lhs);
+    SHARED_STORE(swap->rhs, delete->rhs);
+    swap->height = delete->height;
+    swap->size = delete->size;
+    SHARED_STORE(*link, swap);
+    //! the path went through the removed node, it now goes through swap
+    if (path->depth > delete_depth + 1)
+    {
+        path->links[delete_depth + 1] = &swap->lhs;
+    }
+    retire_node(tree, delete);
+    return 0;
+}
+
+/**
+ * This function removes data from a plain or turbo tree in a single pass
+ * down. The way back up takes the node out of the subtree sizes and, in a
+ * turbo tree, rebalances.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 0 if successful, 1 if data was not found, -1 on failure
+ */
+static int bst_remove(struct tree *tree, int data)
+{
+    struct path path;
+    int status = prepare_change(tree, data, 1);
+    if (status != 0)
+    {
+        return status;
+    }
+    path_init(&path);
+    node **link = descend(tree, data, &path);
+    if (link == NULL)
+    {
+        status = -1;
+    }
+    else if (*link == NULL)
+    {
+        status = 1;
+    }
+    else if (unlink_node(tree, link, &path) != 0)
+    {
+        status = -1;
+    }
+    else
+    {
+        //! every subtree on the way down lost one node
+        for (size_t i = 0; i < path.depth; i++)
+        {
+            (*path.links[i])->size--;
+        }
+        if (tree->turbo == TREE_AVL)
+        {
+            rebalance_path(tree, path.links, path.depth);
+        }
+    }
+    path_cleanup(&path);
+    return status;
+}
+
+/**
+ * This function splays a binary tree top-down: the node with the given key,
+ * or the last node on the way to it, becomes the root. On the way down the
+ * nodes left of the key are collected in a left tree and the nodes right of
+ * it in a right tree, which become the children of the new root. Pairs of
+ * steps in the same direction are rotated first, which roughly halves the
+ * depth of the nodes on the path. The sizes on the right spine of the left
+ * tree and the left spine of the right tree are fixed afterwards.
+ *
+ * @param tree the tree, for its counters
+ * @param root the root of the tree or subtree
+ * @param data the key to splay
+ * @return the new root
+ */
+static node *splay(struct tree *tree, node *root, int data)
+{
+    node header, *left = &header, *right = &header, *tmp;
+    size_t left_size = 0, right_size = 0;
+    if (root == NULL)
+    {
+        return NULL;
+    }
+    header.lhs = NULL;
+    header.rhs = NULL;
+    while (data != root->data)
+    {
+        STAT_VISIT(tree, 1);
+        if (data < root->data)
+        {
+            if (root->lhs == NULL)
+            {
+                break;
+            }
+            //! zig-zig, rotate right first
+            if (data < root->lhs->data)
+            {
+                tmp = root->lhs;
+                root->lhs = tmp->rhs;
+                tmp->rhs = root;
+                root->size = node_size(root->lhs) + node_size(root->rhs) + 1;
+                root = tmp;
+                STAT_RESTRUCTURE(tree, 1);
+                if (root->lhs == NULL)
+                {
+                    break;
+                }
+            }
+            //! link the root into the right tree
+            right->lhs = root;
+            right = root;
+            root = root->lhs;
+            right_size += node_size(right->rhs) + 1;
+        }
+        else
+        {
+            if (root->rhs == NULL)
+            {
+                break;
+            }
+            //! zag-zag, rotate left first
+            if (data > root->rhs->data)
+            {
+                tmp = root->rhs;
+                root->rhs = tmp->lhs;
+                tmp->lhs = root;
+                root->size = node_size(root->lhs) + node_size(root->rhs) + 1;
+                root = tmp;
+                STAT_RESTRUCTURE(tree, 1);
+                if (root->rhs == NULL)
+                {
+                    break;
+                }
+            }
+            //! link the root into the left tree
+            left->rhs = root;
+            left = root;
+            root = root->rhs;
+            left_size += node_size(left->lhs) + 1;
+        }
+    }
+    left_size += node_size(root->lhs);
+    right_size += node_size(root->rhs);
+    root->size = left_size + right_size + 1;
+    left->rhs = NULL;
+    right->lhs = NULL;
+    //! the nodes linked in along the way lost the subtrees below them
+    for (tmp = header.rhs; tmp != NULL; tmp = tmp->rhs)
+    {
+        tmp->size = left_size;
+        left_size -= node_size(tmp->lhs) + 1;
+    }
+    for (tmp = header.lhs; tmp != NULL; tmp = tmp->lhs)
+    {
+        tmp->size = right_size;
+        right_size -= node_size(tmp->rhs) + 1;
+    }
+    left->rhs = root->lhs;
+    right->lhs = root->rhs;
+    root->lhs = header.rhs;
+    root->rhs = header.lhs;
+    return root;
+}
+
+/**
+ * This function searches data in a splay tree and moves it, or the last node
+ * on the way to it, to the root.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 1 if the tree contains the data, 0 otherwise
+ */
+static int splay_find(struct tree *tree, int data)
+{
+    tree->root = splay(tree, tree->root, data);
+    return tree->root != NULL && tree->root->data == data;
+}
+
+/**
+ * This function inserts data into a splay tree, the new node becomes the
+ * root.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 0 if successful, 1 if data was already present, -1 on failure
+ */
+static int splay_insert(struct tree *tree, int data)
+{
+    node *root = splay(tree, tree->root, data);
+    tree->root = root;
+    if (root != NULL && root->data == data)
+    {
+        return 1;
+    }
+    node *new_node = make_node(tree, data);
+    if (new_node == NULL)
+    {
+        return -1;
+    }
+    //! the old root is the neighbour of data, split the tree at it
+    if (root != NULL && data < root->data)
+    {
+        new_node->lhs = root->lhs;
+        new_node->rhs = root;
+        root->lhs = NULL;
+        node_update(root);
+    }
+    else if (root != NULL)
+    {
+        new_node->rhs = root->rhs;
+        new_node->lhs = root;
+        root->rhs = NULL;
+        node_update(root);
+    }
+    node_update(new_node);
+    tree->root = new_node;
+    return 0;
+}
+
+/**
+ * This function removes data from a splay tree. The largest node of the left
+ * subtree is splayed to the top of that subtree and replaces the root.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 0 if successful, 1 if data was not found
+ */
+static int splay_remove(struct tree *tree, int data)
+{
+    node *delete = splay(tree, tree->root, data);
+    tree->root = delete;
+    if (delete == NULL || delete->data != data)
+    {
+        return 1;
+    }
+    if (delete->lhs == NULL)
+    {
+        tree->root = delete->rhs;
+    }
+    else
+    {
+        //! data is larger than every key on the left, so the largest key
+        //! ends up as a root without right child
+        node *root = splay(tree, delete->lhs, data);
+        root->rhs = delete->rhs;
+        node_update(root);
+        tree->root = root;
+    }
+    free_node(tree, delete);
+    return 0;
+}
+
+/* Helper function: Allocate an empty B-tree node, all key slots are set to
+ * INT_MAX. Return a pointer to the new node or NULL on failure. */
+static struct bnode *make_bnode(int leaf)
+{
+    void *memory;
+    if (posix_memalign(&memory, 64, sizeof(struct bnode)) != 0)
+    {
+        return NULL;
+    }
+    struct bnode *new_node = memory;
+    for (int i = 0; i < BTREE_KEYS; i++)
+    {
+        new_node->keys[i] = INT_MAX;
+    }
+    memset(new_node->child, 0, sizeof(new_node->child));
+    new_node->count = 0;
+    new_node->leaf = leaf;
+    new_node->total = 0;
+    new_node->next = NULL;
+    return new_node;
+}
+
+/**
+ * This function counts the keys in the node that are less than data. All
+ * key slots are compared at once, unused slots hold INT_MAX and never count.
+ *
+ * @param b input node
+ * @param data input data
+ * @return number of keys less than data
+ */
+static int bnode_rank(const struct bnode *b, int data)
+{
+#if defined(__AVX2__)
+    __m256i x = _mm256_set1_epi32(data);
+    __m256i lo = _mm256_load_si256((const __m256i *)&b->keys[0]);
+    __m256i hi = _mm256_load_si256((const __m256i *)&b->keys[8]);
+    unsigned mask = (unsigned)_mm256_movemask_ps(
+                        _mm256_castsi256_ps(_mm256_cmpgt_epi32(x, lo))) |
+                    (unsigned)_mm256_movemask_ps(
+                        _mm256_castsi256_ps(_mm256_cmpgt_epi32(x, hi)))
+                        << 8;
+    return __builtin_popcount(mask);
+#elif defined(__SSE2__)
+    __m128i x = _mm_set1_epi32(data);
+    unsigned mask = 0;
+    for (int i = 0; i < BTREE_KEYS; i += 4)
+    {
+        __m128i keys = _mm_load_si128((const __m128i *)&b->keys[i]);
+        mask |= (unsigned)_mm_movemask_ps(
+                    _mm_castsi128_ps(_mm_cmplt_epi32(keys, x)))
+                << i;
+    }
+    return __builtin_popcount(mask);
+#else
+    int i = 0;
+    while (i < b->count && b->keys[i] < data)
+    {
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* Helper function: Return the index of the child of an inner node that
+ * covers data, which is the number of keys not greater than data. */
+static int bnode_child(const struct bnode *b, int data)
+{
+    return data == INT_MAX ? b->count : bnode_rank(b, data + 1);
+}
+
+/**
+ * This function puts a key at position pos of a node that is not full. For
+ * inner nodes right becomes the child right of the key.
+ *
+ * @param b input node
+ * @param pos position of the new key
+ * @param key the new key
+ * @param right the new child, unused for leaves
+ */
+static void bnode_put(struct bnode *b, int pos, int key, struct bnode *right)
+{
+    memmove(&b->keys[pos + 1], &b->keys[pos],
+            (size_t)(b->count - pos) * sizeof(int));
+    b->keys[pos] = key;
+    if (!b->leaf)
+    {
+        memmove(&b->child[pos + 2], &b->child[pos + 1],
+                (size_t)(b->count - pos) * sizeof(struct bnode *));
+        b->child[pos + 1] = right;
+    }
+    b->count++;
+}
+
+/**
+ * This function removes the key at key_pos from a node, and for inner nodes
+ * also the child at child_pos.
+ *
+ * @param b input node
+ * @param key_pos position of the key
+ * @param child_pos position of the child, unused for leaves
+ */
+static void bnode_take(struct bnode *b, int key_pos, int child_pos)
+{
+    memmove(&b->keys[key_pos], &b->keys[key_pos + 1],
+            (size_t)(b->count - key_pos - 1) * sizeof(int));
+    if (!b->leaf)
+    {
+        memmove(&b->child[child_pos], &b->child[child_pos + 1],
+                (size_t)(b->count - child_pos) * sizeof(struct bnode *));
+        b->child[b->count] = NULL;
+    }
+    b->count--;
+    b->keys[b->count] = INT_MAX;
+}
+
+/**
+ * This function splits a full node while a new key is added to it. The upper
+ * half moves to the empty node sibling, which becomes the right neighbour.
+ *
+ * @param b the full node
+ * @param sibling an empty node of the same kind
+ * @param pos position of the new key
+ * @param key the new key
+ * @param right the new child, unused for leaves
+ * @return the separator that has to be added to the parent for sibling
+ */
+static int bnode_split(struct bnode *b, struct bnode *sibling, int pos,
+                       int key, struct bnode *right)
+{
+    int keys[BTREE_KEYS + 1];
+    struct bnode *child[BTREE_KEYS + 2];
+    //! the keys and children of the node with the new key added
+    memcpy(keys, b->keys, (size_t)pos * sizeof(int));
+    keys[pos] = key;
+    memcpy(&keys[pos + 1], &b->keys[pos],
+           (size_t)(BTREE_KEYS - pos) * sizeof(int));
+    if (!b->leaf)
+    {
+        memcpy(child, b->child, (size_t)(pos + 1) * sizeof(struct bnode *));
+        child[pos + 1] = right;
+        memcpy(&child[pos + 2], &b->child[pos + 1],
+               (size_t)(BTREE_KEYS - pos) * sizeof(struct bnode *));
+    }
+    for (int i = BTREE_MIN; i < BTREE_KEYS; i++)
+    {
+        b->keys[i] = INT_MAX;
+    }
+    memcpy(b->keys, keys, BTREE_MIN * sizeof(int));
+    b->count = BTREE_MIN;
+    sibling->next = b->next;
+    b->next = sibling;
+    //! a leaf keeps every key, the separator is a copy of the first right key
+    if (b->leaf)
+    {
+        sibling->count = BTREE_KEYS + 1 - BTREE_MIN;
+        memcpy(sibling->keys, &keys[BTREE_MIN],
+               (size_t)sibling->count * sizeof(int));
+        sibling->total = (size_t)sibling->count;
+        b->total -= sibling->total;
+        return sibling->keys[0];
+    }
+    //! an inner node moves the middle key up to the parent
+    sibling->count = BTREE_KEYS - BTREE_MIN;
+    memcpy(sibling->keys, &keys[BTREE_MIN + 1],
+           (size_t)sibling->count * sizeof(int));
+    memcpy(sibling->child, &child[BTREE_MIN + 1],
+           (size_t)(sibling->count + 1) * sizeof(struct bnode *));
+    memcpy(b->child, child, (BTREE_MIN + 1) * sizeof(struct bnode *));
+    memset(&b->child[BTREE_MIN + 1], 0,
+           (BTREE_KEYS - BTREE_MIN) * sizeof(struct bnode *));
+    for (int i = 0; i <= sibling->count; i++)
+    {
+        sibling->total += sibling->child[i]->total;
+    }
+    b->total -= sibling->total;
+    return keys[BTREE_MIN];
+}
+
+/* Helper function: Return the leaf that would contain data. */
+static struct bnode *btree_leaf(struct bnode *b, int data)
+{
+    while (!b->leaf)
+    {
+        b = b->child[bnode_child(b, data)];
+    }
+    return b;
+}
+
+/* Find data in a turbo 2 tree. Return 1 if the tree contains the data or 0
+ * if the data is not found. */
+static int btree_find(struct tree *tree, int data)
+{
+    if (tree->btree == NULL)
+    {
+        return 0;
+    }
+    struct bnode *leaf = tree->btree;
+    while (!leaf->leaf)
+    {
+        STAT_VISIT(tree, 1);
+        leaf = leaf->child[bnode_child(leaf, data)];
+    }
+    STAT_VISIT(tree, 1);
+    int pos = bnode_rank(leaf, data);
+    return pos < leaf->count && leaf->keys[pos] == data;
+}
+
+/**
+ * This function inserts data into a turbo 2 tree. Full nodes on the way are
+ * split bottom-up, the nodes for the splits are allocated before the tree
+ * is changed so a failed malloc leaves the tree intact.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 0 if successful, 1 if data was already present, -1 on failure
+ */
+static int btree_insert(struct tree *tree, int data)
+{
+    struct bnode *path[TREE_MAX_HEIGHT];
+    int index[TREE_MAX_HEIGHT];
+    struct bnode *spare[TREE_MAX_HEIGHT + 1];
+    size_t depth = 0, needed = 0;
+    if (tree->btree == NULL)
+    {
+        tree->btree = make_bnode(1);
+        if (tree->btree == NULL)
+        {
+            return -1;
+        }
+    }
+    //! search the leaf and remember the way down
+    struct bnode *b = tree->btree;
+    while (!b->leaf)
+    {
+        STAT_VISIT(tree, 1);
+        path[depth] = b;
+        index[depth++] = bnode_child(b, data);
+        b = b->child[index[depth - 1]];
+    }
+    STAT_VISIT(tree, 1);
+    int pos = bnode_rank(b, data);
+    if (pos < b->count && b->keys[pos] == data)
+    {
+        return 1;
+    }
+    //! every full node from the leaf up splits, a full root needs a new root
+    while (needed <= depth &&
+           (needed == 0 ? b : path[depth - needed])->count == BTREE_KEYS)
+    {
+        needed++;
+    }
+    for (size_t i = 0; i < needed + (needed > depth); i++)
+    {
+        spare[i] = make_bnode(i == 0);
+        if (spare[i] == NULL)
+        {
+            while (i > 0)
+            {
+                free(spare[--i]);
+            }
+            return -1;
+        }
+    }
+    //! every node on the way down gets one key more
+    b->total++;
+    for (size_t i = 0; i < depth; i++)
+    {
+        path[i]->total++;
+    }
+    int key = data;
+    struct bnode *right = NULL;
+    for (size_t i = 0;; i++)
+    {
+        if (b->count < BTREE_KEYS)
+        {
+            bnode_put(b, pos, key, right);
+            return 0;
+        }
+        struct bnode *sibling = spare[i];
+        key = bnode_split(b, sibling, pos, key, right);
+        STAT_RESTRUCTURE(tree, 1);
+        right = sibling;
+        //! the root was split, grow the tree by one level
+        if (depth == 0)
+        {
+            struct bnode *root = spare[i + 1];
+            root->leaf = 0;
+            root->keys[0] = key;
+            root->child[0] = b;
+            root->child[1] = right;
+            root->count = 1;
+            root->total = b->total + right->total;
+            tree->btree = root;
+            return 0;
+        }
+        b = path[--depth];
+        pos = index[depth];
+    }
+}
+
+/**
+ * This function refills the node child[i] of parent that has one key too
+ * few, by borrowing a key from a neighbour or by merging with it.
+ *
+ * @param parent the parent of the node
+ * @param i the index of the node in parent
+ * @return 1 if a merge took a key away from parent, 0 otherwise
+ */
+static int btree_refill(struct bnode *parent, int i)
+{
+    struct bnode *b = parent->child[i];
+    struct bnode *left = i > 0 ? parent->child[i - 1] : NULL;
+    struct bnode *right = i < parent->count ? parent->child[i + 1] : NULL;
+    //! borrow the last key of the left neighbour
+    if (left != NULL && left->count > BTREE_MIN)
+    {
+        if (b->leaf)
+        {
+            bnode_put(b, 0, left->keys[left->count - 1], NULL);
+            parent->keys[i - 1] = b->keys[0];
+            b->total++;
+            left->total--;
+        }
+        else
+        {
+            memmove(&b->keys[1], &b->keys[0], (size_t)b->count * sizeof(int));
+            memmove(&b->child[1], &b->child[0],
+                    (size_t)(b->count + 1) * sizeof(struct bnode *));
+            b->keys[0] = parent->keys[i - 1];
+            b->child[0] = left->child[left->count];
+            b->count++;
+            b->total += b->child[0]->total;
+            left->total -= b->child[0]->total;
+            parent->keys[i - 1] = left->keys[left->count - 1];
+            left->child[left->count] = NULL;
+        }
+        left->count--;
+        left->keys[left->count] = INT_MAX;
+        return 0;
+    }
+    //! borrow the first key of the right neighbour
+    if (right != NULL && right->count > BTREE_MIN)
+    {
+        if (b->leaf)
+        {
+            b->keys[b->count++] = right->keys[0];
+            bnode_take(right, 0, 0);
+            parent->keys[i] = right->keys[0];
+            b->total++;
+            right->total--;
+        }
+        else
+        {
+            b->keys[b->count] = parent->keys[i];
+            b->child[b->count + 1] = right->child[0];
+            b->count++;
+            b->total += right->child[0]->total;
+            right->total -= right->child[0]->total;
+            parent->keys[i] = right->keys[0];
+            bnode_take(right, 0, 0);
+        }
+        return 0;
+    }
+    //! else merge with a neighbour, the right one of the pair is freed
+    if (left == NULL)
+    {
+        left = b;
+        i++;
+    }
+    else
+    {
+        right = b;
+    }
+    if (!left->leaf)
+    {
+        left->keys[left->count++] = parent->keys[i - 1];
+        memcpy(&left->child[left->count], right->child,
+               (size_t)(right->count + 1) * sizeof(struct bnode *));
+    }
+    memcpy(&left->keys[left->count], right->keys,
+           (size_t)right->count * sizeof(int));
+    left->count += right->count;
+    left->total += right->total;
+    left->next = right->next;
+    free(right);
+    bnode_take(parent, i - 1, i);
+    return 1;
+}
+
+/**
+ * This function removes data from a turbo 2 tree. Nodes that get too few
+ * keys borrow from or merge with a neighbour, bottom-up.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 0 if successful, 1 if data was not found
+ */
+static int btree_remove(struct tree *tree, int data)
+{
+    struct bnode *path[TREE_MAX_HEIGHT];
+    int index[TREE_MAX_HEIGHT];
+    size_t depth = 0;
+    if (tree->btree == NULL)
+    {
+        return 1;
+    }
+    //! search the leaf and remember the way down
+    struct bnode *b = tree->btree;
+    while (!b->leaf)
+    {
+        STAT_VISIT(tree, 1);
+        path[depth] = b;
+        index[depth++] = bnode_child(b, data);
+        b = b->child[index[depth - 1]];
+    }
+    STAT_VISIT(tree, 1);
+    int pos = bnode_rank(b, data);
+    if (pos >= b->count || b->keys[pos] != data)
+    {
+        return 1;
+    }
+    bnode_take(b, pos, pos);
+    //! every node on the way down lost one key
+    b->total--;
+    for (size_t i = 0; i < depth; i++)
+    {
+        path[i]->total--;
+    }
+    while (depth > 0 && b->count < BTREE_MIN)
+    {
+        depth--;
+        STAT_RESTRUCTURE(tree, 1);
+        if (btree_refill(path[depth], index[depth]) == 0)
+        {
+            break;
+        }
+        b = path[depth];
+    }
+    //! shrink the tree if the root ran empty
+    struct bnode *root = tree->btree;
+    if (root->count == 0)
+    {
+        tree->btree = root->leaf ? NULL : root->child[0];
+        free(root);
+    }
+    return 0;
+}
+
+/* Helper function: Free all nodes of a B-tree, level by level along the
+ * neighbour links. */
+static void btree_cleanup(struct bnode *b)
+{
+    while (b != NULL)
+    {
+        struct bnode *below = b->leaf ? NULL : b->child[0];
+        while (b != NULL)
+        {
+            struct bnode *tmp = b;
+            b = b->next;
+            free(tmp);
+        }
+        b = below;
+    }
+}
+
+/**
+ * This function builds a turbo 2 tree bottom-up from sorted keys. The keys
+ * are spread evenly over as few leaves as can hold them, and the nodes of
+ * every row over as few parents as can hold them, so every node except the
+ * root has at least BTREE_MIN keys. The separator in front of a child is the
+ * smallest key below it.
+ *
+ * @param sorted the keys in increasing order, without duplicates
+ * @param size number of keys
+ * @param root output, the root of the tree, NULL if size is 0
+ * @return 0 if successful and -1 on failure
+ */
+static int btree_build(const int *sorted, size_t size, struct bnode **root)
+{
+    struct bnode *first[TREE_MAX_HEIGHT];
+    struct bnode *below = NULL;
+    int rows = 0;
+    *root = NULL;
+    if (size == 0)
+    {
+        return 0;
+    }
+    //! the smallest key below every node of the row
+    int *low = malloc((size + BTREE_KEYS - 1) / BTREE_KEYS * sizeof(int));
+    if (low == NULL)
+    {
+        return -1;
+    }
+    //! items are keys for the leaves and nodes of the row below otherwise
+    size_t items = size;
+    while (rows == 0 || items > 1)
+    {
+        int leaf = rows == 0;
+        size_t room = leaf ? BTREE_KEYS : BTREE_KEYS + 1;
+        size_t count = (items + room - 1) / room;
+        struct bnode *prev = NULL;
+        first[rows] = NULL;
+        for (size_t i = 0; i < count; i++)
+        {
+            struct bnode *b = make_bnode(leaf);
+            if (b == NULL)
+            {
+                //! every row built so far is linked through next
+                for (int row = 0; row <= rows; row++)
+                {
+                    while (first[row] != NULL)
+                    {
+                        struct bnode *tmp = first[row];
+                        first[row] = tmp->next;
+                        free(tmp);
+                    }
+                }
+                free(low);
+                return -1;
+            }
+            if (prev == NULL)
+            {
+                first[rows] = b;
+            }
+            else
+            {
+                prev->next = b;
+            }
+            prev = b;
+            //! the items of the nodes differ at most one in number
+            size_t begin = items * i / count;
+            size_t end = items * (i + 1) / count;
+            if (leaf)
+            {
+                memcpy(b->keys, &sorted[begin], (end - begin) * sizeof(int));
+                b->count = (int)(end - begin);
+                b->total = end - begin;
+                low[i] = sorted[begin];
+                continue;
+            }
+            for (size_t j = begin; j < end; j++)
+            {
+                if (j > begin)
+                {
+                    b->keys[j - begin - 1] = low[j];
+                }
+                b->child[j - begin] = below;
+                b->total += below->total;
+                below = below->next;
+            }
+            b->count = (int)(end - begin - 1);
+            //! begin is at least i, so low[begin] is not overwritten yet
+            low[i] = low[begin];
+        }
+        below = first[rows++];
+        items = count;
+    }
+    free(low);
+    *root = below;
+    return 0;
+}
+
+/* Helper function: Return the leftmost leaf of a B-tree or NULL if it is
+ * empty. */
+static struct bnode *btree_first(struct bnode *b)
+{
+    while (b != NULL && !b->leaf)
+    {
+        b = b->child[0];
+    }
+    return b;
+}
+
+/**
+ * This function writes the subtree in dot format. The nodes are numbered in
+ * preorder, empty children become points. A heap allocated stack holds the
+ * children that still have to be written.
+ *
+ * @param root the root of the subtree
+ * @param dotf the output file
+ * @return 0 if successful, -1 on failure
+ */
+static int print_tree_dot(node *root, FILE *dotf)
+{
+    //! a child that still has to be written, with the id of its parent
+    struct dot_item
+    {
+        node *n;
+        int parent_id;
+        char side;
+    } *stack;
+    size_t top = 0, stack_size = 2 * TREE_MAX_HEIGHT;
+    int counter = 0;
+    stack = malloc(stack_size * sizeof(struct dot_item));
+    if (stack == NULL)
+    {
+        return -1;
+    }
+    stack[top++] = (struct dot_item){root, -1, 0};
+    while (top > 0)
+    {
+        struct dot_item item = stack[--top];
+        int my_id = counter++;
+        if (item.parent_id >= 0)
+        {
+            fprintf(dotf, "    %d -> %d [label=\"%c\"]\n", item.parent_id, my_id,
+                    item.side);
+        }
+        if (item.n == NULL)
+        {
+            fprintf(dotf, "    %d [shape=point];\n", my_id);
+            continue;
+        }
+        fprintf(dotf, "    %d [color=%s label=\"%d\"]\n", my_id, "black",
+                item.n->data);
+        if (top + 2 > stack_size)
+        {
+            struct dot_item *bigger =
+                realloc(stack, 2 * stack_size * sizeof(struct dot_item));
+            if (bigger == NULL)
+            {
+                free(stack);
+                return -1;
+            }
+            stack = bigger;
+            stack_size *= 2;
+        }
+        //! the left child is written first, so it goes on the stack last
+        stack[top++] = (struct dot_item){item.n->rhs, my_id, 'r'};
+        stack[top++] = (struct dot_item){item.n->lhs, my_id, 'l'};
+    }
+    free(stack);
+    return 0;
+}
+
+/* Helper function: Write the nodes of a B-tree in dot format, level by level
+ * along the neighbour links. */
+static void btree_dot(struct bnode *b, FILE *dotf)
+{
+    while (b != NULL)
+    {
+        struct bnode *below = b->leaf ? NULL : b->child[0];
+        for (; b != NULL; b = b->next)
+        {
+            fprintf(dotf, "    \"%p\" [shape=record label=\"", (void *)b);
+            for (int i = 0; i < b->count; i++)
+            {
+                fprintf(dotf, i == 0 ? "%d" : "|%d", b->keys[i]);
+            }
+            fprintf(dotf, "\"]\n");
+            for (int i = 0; !b->leaf && i <= b->count; i++)
+            {
+                fprintf(dotf, "    \"%p\" -> \"%p\"\n", (void *)b,
+                        (void *)b->child[i]);
+            }
+        }
+        b = below;
+    }
+}
+
+void tree_dot(struct tree *tree, char *filename)
+{
+    node *root = tree->root;
+    FILE *dotf = fopen(filename, "w");
+    if (!dotf)
+    {
+        printf("error opening file: %s\n", filename);
+        exit(1);
+    }
+    fprintf(dotf, "digraph {\n");
+    if (tree->turbo == TREE_BTREE)
+    {
+        btree_dot(tree->btree, dotf);
+    }
+    else if (root && print_tree_dot(root, dotf) != 0)
+    {
+        printf("error writing file: %s\n", filename);
+    }
+    fprintf(dotf, "}\n");
+    fclose(dotf);
+}
+
+/**
+ * This function points to the parent of the node that containst the given data.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return the parent of the node, or NULL if data is in the root or not in
+ * the tree
+ */
+struct node *previous(struct tree *tree, int data)
+{
+    //! begins with the root
+    struct node *tmp = tree->root;
+    while (tmp != NULL && tmp->data != data)
+    {
+        struct node *child = data < tmp->data ? tmp->lhs : tmp->rhs;
+        //! return the node if its child contains the given data
+        if (child != NULL && child->data == data)
+        {
+            return tmp;
+        }
+        tmp = child;
+    }
+    return NULL;
+}
+
+/**
+ * This function deletes the root of the given tree.
+ *
+ * @param tree input tree
+ */
+void delete_root(struct tree *tree)
+{
+    if (tree->root != NULL)
+    {
+        bst_remove(tree, tree->root->data);
+    }
+}
+
+/**
+ * This function deletes the node that containst the data.
+ *
+ * @param tree input tree
+ */
+void delete_node(struct tree *tree, int data)
+{
+    bst_remove(tree, data);
+}
+
+/* Return a pointer to a new tree. Return NULL on failure.
+ * If the turbo flag is 0 the tree is initialized as a regular
+ * binary search tree. If the turbo flag is 1 the tree is initialized
+ * as a fast balanced binary search tree. If the turbo flag is 2 the
+ * tree is initialized as a cache friendly B+-tree. If the turbo flag is 3
+ * the tree is initialized as a splay tree, where tree_find moves the data
+ * it looks up to the root, so keys that are looked up often stay near the
+ * top. Adding TREE_CONCURRENT to flag 0 or 1 makes a tree that can be
+ * shared between threads: tree_find then takes no lock and tree_insert and
+ * tree_remove are serialized. Other calls must not run concurrently with a
+ * writer. */
+struct tree *tree_init(int turbo)
+{
+    int concurrent = (turbo & TREE_CONCURRENT) != 0;
+    turbo &= ~TREE_CONCURRENT;
+    //! only binary trees can be concurrent, B-tree nodes are really freed
+    //! and a lookup in a splay tree changes it
+    if (turbo == TREE_PLAIN || turbo == TREE_AVL ||
+        ((turbo == TREE_BTREE || turbo == TREE_SPLAY) && !concurrent))
+    {
+        //! return NULL if malloc failed
+        struct tree *new_tree = malloc(sizeof(struct tree));
+        if (new_tree == NULL)
+        {
+            return NULL;
+        }
+        new_tree->root = NULL;
+        new_tree->turbo = turbo;
+        new_tree->btree = NULL;
+        new_tree->slabs = NULL;
+        new_tree->slab_used = 0;
+        new_tree->free_list = NULL;
+        new_tree->concurrent = concurrent;
+        new_tree->version = 0;
+        new_tree->origin = NULL;
+        new_tree->generation = 1;
+        new_tree->shared = 0;
+        new_tree->first_snapshot = NULL;
+        new_tree->last_snapshot = NULL;
+        new_tree->prev_snapshot = NULL;
+        new_tree->next_snapshot = NULL;
+        new_tree->retired = NULL;
+        new_tree->retired_count = 0;
+        new_tree->retired_size = 0;
+        new_tree->closed = 0;
+#ifdef TREE_STATS
+        memset(&new_tree->counters, 0, sizeof(struct tree_counters));
+#endif
+        if (concurrent && pthread_mutex_init(&new_tree->lock, NULL) != 0)
+        {
+            free(new_tree);
+            return NULL;
+        }
+        //! return the new tree
+        return new_tree;
+    }
+    return NULL;
+}
+
+/* Helper function: Push a node on the stack of the iterator, the stack grows
+ * when it is full. Return 0 if successful and -1 on failure. */
+static int iter_push(struct tree_iter *it, node *n)
+{
+    if (it->top == it->stack_size)
+    {
+        node **bigger = realloc(it->stack, 2 * it->stack_size * sizeof(node *));
+        if (bigger == NULL)
+        {
+            return -1;
+        }
+        it->stack = bigger;
+        it->stack_size *= 2;
+    }
+    it->stack[it->top++] = n;
+    return 0;
+}
+
+/* Helper function: Push n and its chain of left children on the stack of the
+ * iterator. Return 0 if successful and -1 on failure. */
+static int iter_push_left(struct tree_iter *it, node *n)
+{
+    for (; n != NULL; n = n->lhs)
+    {
+        if (iter_push(it, n) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Free all memory associated with the cursor. */
+void tree_iter_cleanup(struct tree_iter *it)
+{
+    if (it != NULL)
+    {
+        free(it->stack);
+        free(it);
+    }
+}
+
+/* Return a cursor positioned before the smallest item of the tree, or NULL
+ * on failure. The cursor is invalid after the tree is changed. */
+struct tree_iter *tree_iter_begin(struct tree *tree)
+{
+    if (tree == NULL)
+    {
+        return NULL;
+    }
+    struct tree_iter *it = malloc(sizeof(struct tree_iter));
+    if (it == NULL)
+    {
+        return NULL;
+    }
+    it->stack_size = TREE_MAX_HEIGHT;
+    it->stack = malloc(it->stack_size * sizeof(node *));
+    if (it->stack == NULL)
+    {
+        free(it);
+        return NULL;
+    }
+    it->tree = tree;
+    it->top = 0;
+    it->leaf = btree_first(tree->btree);
+    it->pos = 0;
+    if (iter_push_left(it, tree->root) != 0)
+    {
+        tree_iter_cleanup(it);
+        return NULL;
+    }
+    return it;
+}
+
+/* Position the cursor before the smallest item that is not less than key.
+ * Return 0 if successful and -1 on failure. */
+int tree_iter_seek(struct tree_iter *it, int key)
+{
+    if (it == NULL)
+    {
+        return -1;
+    }
+    if (it->tree->turbo == TREE_BTREE)
+    {
+        it->leaf = NULL;
+        if (it->tree->btree != NULL)
+        {
+            it->leaf = btree_leaf(it->tree->btree, key);
+            it->pos = bnode_rank(it->leaf, key);
+        }
+        return 0;
+    }
+    //! keep the nodes where the search went left, those come after key
+    it->top = 0;
+    for (node *tmp = it->tree->root; tmp != NULL;)
+    {
+        if (tmp->data >= key)
+        {
+            if (iter_push(it, tmp) != 0)
+            {
+                return -1;
+            }
+            tmp = tmp->lhs;
+        }
+        else
+        {
+            tmp = tmp->rhs;
+        }
+    }
+    return 0;
+}
+
+/* Advance the cursor and store the next item in *data. Return 1 if there
+ * was a next item, 0 at the end of the tree and -1 on failure. */
+int tree_iter_next(struct tree_iter *it, int *data)
+{
+    if (it == NULL || data == NULL)
+    {
+        return -1;
+    }
+    if (it->tree->turbo == TREE_BTREE)
+    {
+        //! continue in the next leaf when this one is done
+        while (it->leaf != NULL && it->pos >= it->leaf->count)
+        {
+            it->leaf = it->leaf->next;
+            it->pos = 0;
+        }
+        if (it->leaf == NULL)
+        {
+            return 0;
+        }
+        *data = it->leaf->keys[it->pos++];
+        return 1;
+    }
+    if (it->top == 0)
+    {
+        return 0;
+    }
+    node *tmp = it->stack[--it->top];
+    if (iter_push_left(it, tmp->rhs) != 0)
+    {
+        return -1;
+    }
+    *data = tmp->data;
+    return 1;
+}
+
+/* Helper function: compare two ints for qsort. */
+static int compare_int(const void *a, const void *b)
+{
+    int lhs = *(const int *)a;
+    int rhs = *(const int *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * This function builds a turbo tree of minimum height from n strictly
+ * increasing keys in linear time. All nodes are carved from one slab.
+ *
+ * @param keys the sorted keys without duplicates
+ * @param n number of keys
+ * @return the new tree or NULL on failure
+ */
+static struct tree *build_balanced(const int *keys, size_t n)
+{
+    //! a range of keys that still has to become the subtree at *link
+    struct range
+    {
+        size_t lo;
+        size_t hi;
+        node **link;
+    } stack[2 * TREE_MAX_HEIGHT];
+    size_t top = 0;
+    struct tree *tree = tree_init(TREE_AVL);
+    if (tree == NULL)
+    {
+        return NULL;
+    }
+    if (n == 0)
+    {
+        return tree;
+    }
+    if (add_slab(tree, n) != 0)
+    {
+        tree_cleanup(tree);
+        return NULL;
+    }
+    stack[top++] = (struct range){0, n, &tree->root};
+    while (top > 0)
+    {
+        struct range r = stack[--top];
+        if (r.lo == r.hi)
+        {
+            *r.link = NULL;
+            continue;
+        }
+        //! the middle key is the root, the halves become the subtrees
+        size_t mid = r.lo + (r.hi - r.lo) / 2;
+        node *new_node = make_node(tree, keys[mid]);
+        //! a subtree of m keys split this way is exactly bitlength(m) high
+        new_node->height = 64 - __builtin_clzll((unsigned long long)(r.hi - r.lo));
+        new_node->size = r.hi - r.lo;
+        *r.link = new_node;
+        stack[top++] = (struct range){mid + 1, r.hi, &new_node->rhs};
+        stack[top++] = (struct range){r.lo, mid, &new_node->lhs};
+    }
+    return tree;
+}
+
+/* Build a balanced (turbo) tree from keys sorted in increasing order in
+ * linear time. Duplicate keys are stored once. Return NULL if the keys are
+ * not sorted or on failure. */
+struct tree *tree_build_sorted(const int *keys, size_t n)
+{
+    if (keys == NULL && n > 0)
+    {
+        return NULL;
+    }
+    //! check the order and count the duplicates
+    size_t duplicates = 0;
+    for (size_t i = 1; i < n; i++)
+    {
+        if (keys[i] < keys[i - 1])
+        {
+            return NULL;
+        }
+        duplicates += keys[i] == keys[i - 1];
+    }
+    if (duplicates == 0)
+    {
+        return build_balanced(keys, n);
+    }
+    //! else build from a copy without the duplicates
+    int *unique = malloc((n - duplicates) * sizeof(int));
+    if (unique == NULL)
+    {
+        return NULL;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == 0 || keys[i] != keys[i - 1])
+        {
+            unique[count++] = keys[i];
+        }
+    }
+    struct tree *tree = build_balanced(unique, count);
+    free(unique);
+    return tree;
+}
+
+/* Build a balanced (turbo) tree from keys in any order. The keys are sorted
+ * into a copy first. Duplicate keys are stored once. Return NULL on
+ * failure. */
+struct tree *tree_build(const int *keys, size_t n)
+{
+    if (keys == NULL && n > 0)
+    {
+        return NULL;
+    }
+    else if (n == 0)
+    {
+        return tree_init(TREE_AVL);
+    }
+    int *sorted = malloc(n * sizeof(int));
+    if (sorted == NULL)
+    {
+        return NULL;
+    }
+    memcpy(sorted, keys, n * sizeof(int));
+    qsort(sorted, n, sizeof(int), compare_int);
+    //! remove the duplicates in place
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (count == 0 || sorted[i] != sorted[count - 1])
+        {
+            sorted[count++] = sorted[i];
+        }
+    }
+    struct tree *tree = build_balanced(sorted, count);
+    free(sorted);
+    return tree;
+}
+
+/**
+ * This function copies the keys of the tree in sorted order into a new array.
+ *
+ * @param tree input tree
+ * @param size output, number of keys copied
+ * @return the malloc'd array of keys or NULL on failure
+ */
+static int *tree_keys(struct tree *tree, size_t *size)
+{
+    size_t count = 0, capacity = 1024;
+    int *keys = malloc(capacity * sizeof(int));
+    struct tree_iter *it = tree_iter_begin(tree);
+    int data, status;
+    if (keys == NULL || it == NULL)
+    {
+        free(keys);
+        tree_iter_cleanup(it);
+        return NULL;
+    }
+    while ((status = tree_iter_next(it, &data)) == 1)
+    {
+        if (count == capacity)
+        {
+            int *bigger = realloc(keys, 2 * capacity * sizeof(int));
+            if (bigger == NULL)
+            {
+                status = -1;
+                break;
+            }
+            keys = bigger;
+            capacity *= 2;
+        }
+        keys[count++] = data;
+    }
+    tree_iter_cleanup(it);
+    if (status != 0)
+    {
+        free(keys);
+        return NULL;
+    }
+    *size = count;
+    return keys;
+}
+
+/* Helper function: Return the index of the smallest key in the subtree at
+ * index k of an implicit tree with size keys in Eytzinger order. */
+static size_t eytzinger_first(size_t k, size_t size)
+{
+    while (2 * k <= size)
+    {
+        k = 2 * k;
+    }
+    return k;
+}
+
+/* Helper function: Return the index of the key after the key at index k of
+ * an implicit tree with size keys in Eytzinger order, or 0 after the last
+ * key. */
+static size_t eytzinger_next(size_t k, size_t size)
+{
+    //! next is the leftmost node of the right subtree if there is one
+    if (2 * k + 1 <= size)
+    {
+        return eytzinger_first(2 * k + 1, size);
+    }
+    //! else the first ancestor of which we are in the left subtree
+    while (k & 1)
+    {
+        k >>= 1;
+    }
+    return k >> 1;
+}
+
+/**
+ * This function makes a frozen tree from keys in sorted order by placing
+ * them in Eytzinger order. It walks the implicit tree in order, so the
+ * sorted keys can be consumed front to back.
+ *
+ * @param sorted the keys in increasing order
+ * @param size number of keys
+ * @return the frozen tree or NULL on failure
+ */
+static struct frozen_tree *frozen_from_sorted(const int *sorted, size_t size)
+{
+    struct frozen_tree *frozen = malloc(sizeof(struct frozen_tree));
+    if (frozen == NULL)
+    {
+        return NULL;
+    }
+    //! whole cache lines, the last one is not shared with other data
+    size_t bytes = ((size + 1) * sizeof(int) + 63) / 64 * 64;
+    void *keys;
+    if (posix_memalign(&keys, 64, bytes) != 0)
+    {
+        free(frozen);
+        return NULL;
+    }
+    frozen->keys = keys;
+    frozen->size = size;
+    frozen->map = NULL;
+    frozen->map_size = 0;
+    size_t k = eytzinger_first(1, size);
+    for (size_t i = 0; i < size; i++)
+    {
+        frozen->keys[k] = sorted[i];
+        k = eytzinger_next(k, size);
+    }
+    return frozen;
+}
+
+/* Return an immutable, cache friendly copy of the keys of the tree that can
+ * be searched with frozen_find. The tree itself is not changed. Return NULL
+ * on failure. */
+struct frozen_tree *tree_freeze(struct tree *tree)
+{
+    if (tree == NULL)
+    {
+        return NULL;
+    }
+    size_t size;
+    int *sorted = tree_keys(tree, &size);
+    if (sorted == NULL)
+    {
+        return NULL;
+    }
+    struct frozen_tree *frozen = frozen_from_sorted(sorted, size);
+    free(sorted);
+    return frozen;
+}
+
+/* Find data in a frozen tree. Return 1 if it contains the data or 0 if the
+ * data is not found. The descent has no data dependent branches: every step
+ * goes to child 2k or 2k + 1 depending on the comparison, and the cache line
+ * four levels further down is prefetched while this level is compared. */
+int frozen_find(const struct frozen_tree *frozen, int data)
+{
+    if (frozen == NULL)
+    {
+        return 0;
+    }
+    const int *keys = frozen->keys;
+    size_t k = 1;
+    while (k <= frozen->size)
+    {
+        __builtin_prefetch(keys + 16 * k);
+        k = 2 * k + (keys[k] < data);
+    }
+    //! undo the right turns after the last left turn, that node is the
+    //! smallest key that is not less than data
+    k >>= __builtin_ffsll(~k);
+    return k != 0 && keys[k] == data;
+}
+
+/* Free all memory associated with the frozen tree. */
+void frozen_cleanup(struct frozen_tree *frozen)
+{
+    if (frozen != NULL)
+    {
+        if (frozen->map != NULL)
+        {
+            munmap(frozen->map, frozen->map_size);
+        }
+        else
+        {
+            free(frozen->keys);
+        }
+        free(frozen);
+    }
+}
+
+/* Write the tree to a binary file that tree_load and frozen_map can read.
+ * The keys are stored in the layout of a frozen tree, in the byte order of
+ * this machine. Return 0 if successful and -1 on failure. */
+int tree_save(struct tree *tree, const char *filename)
+{
+    if (tree == NULL || filename == NULL)
+    {
+        return -1;
+    }
+    struct frozen_tree *frozen = tree_freeze(tree);
+    if (frozen == NULL)
+    {
+        return -1;
+    }
+    struct tree_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TREE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TREE_FILE_VERSION;
+    header.byte_order = 0x01020304;
+    header.key_size = sizeof(int);
+    header.turbo = (uint32_t)tree->turbo;
+    header.size = frozen->size;
+    //! slot 0 of the keys is unused, write a zero there
+    frozen->keys[0] = 0;
+    FILE *file = fopen(filename, "wb");
+    int status = -1;
+    if (file != NULL)
+    {
+        if (fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(frozen->keys, sizeof(int), frozen->size + 1, file) ==
+                frozen->size + 1)
+        {
+            status = 0;
+        }
+        if (fclose(file) != 0)
+        {
+            status = -1;
+        }
+    }
+    frozen_cleanup(frozen);
+    return status;
+}
+
+/**
+ * This function maps a file written by tree_save into memory and checks its
+ * header. The order of the keys is not checked.
+ *
+ * @param filename the file
+ * @return the frozen tree of the file, NULL if the file can not be mapped or
+ * was not written by tree_save on a machine like this one
+ */
+static struct frozen_tree *map_tree_file(const char *filename)
+{
+    struct stat info;
+    if (filename == NULL)
+    {
+        return NULL;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 ||
+        (size_t)info.st_size < sizeof(struct tree_file_header) + sizeof(int))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t map_size = (size_t)info.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    const struct tree_file_header *header = map;
+    //! the keys have to be complete and readable on this machine
+    if (memcmp(header->magic, TREE_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TREE_FILE_VERSION ||
+        header->byte_order != 0x01020304 || header->key_size != sizeof(int) ||
+        header->size > (map_size - sizeof(*header)) / sizeof(int) - 1)
+    {
+        munmap(map, map_size);
+        return NULL;
+    }
+    struct frozen_tree *frozen = malloc(sizeof(struct frozen_tree));
+    if (frozen == NULL)
+    {
+        munmap(map, map_size);
+        return NULL;
+    }
+    frozen->keys = (int *)((char *)map + sizeof(*header));
+    frozen->size = (size_t)header->size;
+    frozen->map = map;
+    frozen->map_size = map_size;
+    return frozen;
+}
+
+/* Map a file written by tree_save into memory as a frozen tree. The keys
+ * are read once to check that they are in Eytzinger order, after that they
+ * are searched in place with frozen_find. Return NULL if the file can not
+ * be mapped, was not written by tree_save on a machine like this one or is
+ * corrupt. */
+struct frozen_tree *frozen_map(const char *filename)
+{
+    struct frozen_tree *frozen = map_tree_file(filename);
+    if (frozen == NULL)
+    {
+        return NULL;
+    }
+    //! a search only works if the keys come out of the implicit tree in order
+    size_t k = eytzinger_first(1, frozen->size);
+    for (size_t i = 1; i < frozen->size; i++)
+    {
+        size_t next = eytzinger_next(k, frozen->size);
+        if (frozen->keys[k] >= frozen->keys[next])
+        {
+            frozen_cleanup(frozen);
+            return NULL;
+        }
+        k = next;
+    }
+    return frozen;
+}
+
+/* Read a tree written by tree_save. The tree is rebuilt from the sorted keys
+ * in linear time, as the same kind of tree that was saved. Return NULL on
+ * failure or if the file is corrupt. */
+struct tree *tree_load(const char *filename)
+{
+    struct frozen_tree *frozen = map_tree_file(filename);
+    if (frozen == NULL)
+    {
+        return NULL;
+    }
+    int turbo = (int)((const struct tree_file_header *)frozen->map)->turbo;
+    int *sorted = malloc((frozen->size > 0 ? frozen->size : 1) * sizeof(int));
+    if (sorted == NULL || (turbo != TREE_PLAIN && turbo != TREE_AVL &&
+                           turbo != TREE_BTREE && turbo != TREE_SPLAY))
+    {
+        free(sorted);
+        frozen_cleanup(frozen);
+        return NULL;
+    }
+    //! the keys come out of the implicit tree in order, unless the file is
+    //! corrupt
+    size_t k = eytzinger_first(1, frozen->size);
+    for (size_t i = 0; i < frozen->size; i++)
+    {
+        sorted[i] = frozen->keys[k];
+        k = eytzinger_next(k, frozen->size);
+        if (i > 0 && sorted[i - 1] >= sorted[i])
+        {
+            free(sorted);
+            frozen_cleanup(frozen);
+            return NULL;
+        }
+    }
+    struct tree *tree;
+    if (turbo == TREE_BTREE)
+    {
+        tree = tree_init(TREE_BTREE);
+        if (tree != NULL &&
+            btree_build(sorted, frozen->size, &tree->btree) != 0)
+        {
+            tree_cleanup(tree);
+            tree = NULL;
+        }
+    }
+    //! a balanced shape is fine for a plain or splay tree too
+    else
+    {
+        tree = build_balanced(sorted, frozen->size);
+        if (tree != NULL)
+        {
+            tree->turbo = turbo;
+        }
+    }
+    free(sorted);
+    frozen_cleanup(frozen);
+    return tree;
+}
+
+/**
+ * This function searches data in a concurrent tree without taking the lock.
+ * The walk is checked against the version of the tree: if a writer was busy
+ * or finished in the meantime the walk is repeated, after a few attempts
+ * under the lock. Nodes are never given back to the system before
+ * tree_cleanup, only to the free list of the tree, so a walk that races
+ * with a writer reads stale nodes but never freed memory.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 1 if the tree contains the data, 0 otherwise
+ */
+static int concurrent_find(struct tree *tree, int data)
+{
+    for (int attempt = 0; attempt < CONCURRENT_RETRIES; attempt++)
+    {
+        unsigned long version = __atomic_load_n(&tree->version, __ATOMIC_ACQUIRE);
+        //! a writer is busy
+        if (version & 1)
+        {
+            continue;
+        }
+        int found = 0, torn = 0;
+        size_t steps = 0;
+        node *tmp = __atomic_load_n(&tree->root, __ATOMIC_RELAXED);
+        while (tmp != NULL)
+        {
+            int key = __atomic_load_n(&tmp->data, __ATOMIC_RELAXED);
+            if (key == data)
+            {
+                found = 1;
+                break;
+            }
+            tmp = __atomic_load_n(data < key ? &tmp->lhs : &tmp->rhs,
+                                  __ATOMIC_RELAXED);
+            //! a walk through reused nodes can go in circles, so check
+            //! now and then if it is still valid
+            if (++steps % CONCURRENT_CHECK == 0 &&
+                __atomic_load_n(&tree->version, __ATOMIC_RELAXED) != version)
+            {
+                torn = 1;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!torn && __atomic_load_n(&tree->version, __ATOMIC_RELAXED) == version)
+        {
+            return found;
+        }
+    }
+    //! too many writers in the way, wait for them
+    pthread_mutex_lock(&tree->lock);
+    int found = bst_find(tree, data);
+    pthread_mutex_unlock(&tree->lock);
+    return found;
+}
+
+/* Find data in the tree. Return 1 if the tree contains the data or
+ * 0 if the data is not found. A splay tree moves the data, or the node
+ * where the search ended, to the root. */
+int tree_find(struct tree *tree, int data)
+{
+    int found;
+    //! if tree is NULL
+    if (tree == NULL)
+    {
+        return 0;
+    }
+    //! lock-free lookups are not counted, they would race on the counters
+    else if (tree->concurrent)
+    {
+        return concurrent_find(tree, data);
+    }
+    STAT_START(tree);
+    if (tree->turbo == TREE_BTREE)
+    {
+        found = btree_find(tree, data);
+    }
+    else if (tree->turbo == TREE_SPLAY)
+    {
+        found = splay_find(tree, data);
+    }
+    else
+    {
+        found = bst_find(tree, data);
+    }
+    STAT_STOP(tree, STAT_FIND);
+    return found;
+}
+
+/**
+ * This function looks up a group of at most FIND_GROUP keys at once. Every
+ * round each unfinished lookup takes one step down and prefetches the node
+ * it arrives at, so the cache misses of the whole group overlap instead of
+ * following each other.
+ *
+ * @param tree input tree, not a concurrent one
+ * @param keys the keys to look up
+ * @param n number of keys
+ * @param out out[i] is set to 1 if keys[i] is found, 0 otherwise
+ */
+static void find_group(struct tree *tree, const int *keys, size_t n,
+                       uint8_t *out)
+{
+    node *cur[FIND_GROUP];
+    struct bnode *bcur[FIND_GROUP];
+    size_t active[FIND_GROUP];
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = 0;
+        cur[i] = tree->root;
+        bcur[i] = tree->btree;
+        if (cur[i] != NULL || bcur[i] != NULL)
+        {
+            active[count++] = i;
+        }
+    }
+    while (count > 0)
+    {
+        for (size_t j = 0; j < count;)
+        {
+            size_t i = active[j];
+            int done;
+            if (tree->turbo == TREE_BTREE)
+            {
+                struct bnode *b = bcur[i];
+                if (b->leaf)
+                {
+                    int pos = bnode_rank(b, keys[i]);
+                    out[i] = pos < b->count && b->keys[pos] == keys[i];
+                    done = 1;
+                }
+                else
+                {
+                    bcur[i] = b->child[bnode_child(b, keys[i])];
+                    __builtin_prefetch(bcur[i]);
+                    done = 0;
+                }
+            }
+            else
+            {
+                node *tmp = cur[i];
+                if (tmp->data == keys[i])
+                {
+                    out[i] = 1;
+                    done = 1;
+                }
+                else
+                {
+                    tmp = keys[i] < tmp->data ? tmp->lhs : tmp->rhs;
+                    cur[i] = tmp;
+                    __builtin_prefetch(tmp);
+                    done = tmp == NULL;
+                }
+            }
+            //! a finished lookup makes room for the last active one
+            if (done)
+            {
+                active[j] = active[--count];
+            }
+            else
+            {
+                j++;
+            }
+        }
+    }
+}
+
+/* Look up n keys at once and set out[i] to 1 if the tree contains keys[i]
+ * or to 0 if it does not. The lookups are interleaved to hide the memory
+ * latency, which makes this faster than calling tree_find in a loop for
+ * large batches. Return 0 if successful and -1 on failure. */
+int tree_find_many(struct tree *tree, const int *keys, size_t n, uint8_t *out)
+{
+    if (tree == NULL || ((keys == NULL || out == NULL) && n > 0))
+    {
+        return -1;
+    }
+    //! lock-free readers have to validate every walk on their own
+    if (tree->concurrent)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = (uint8_t)concurrent_find(tree, keys[i]);
+        }
+        return 0;
+    }
+    for (size_t i = 0; i < n; i += FIND_GROUP)
+    {
+        find_group(tree, &keys[i], n - i < FIND_GROUP ? n - i : FIND_GROUP,
+                   &out[i]);
+    }
+    return 0;
+}
+
+/* Helper function: Start a change of a concurrent tree. The version becomes
+ * odd, so lock-free readers know their walk may be invalid. */
+static void write_begin(struct tree *tree)
+{
+    pthread_mutex_lock(&tree->lock);
+    __atomic_store_n(&tree->version, tree->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Helper function: Finish a change of a concurrent tree and publish it. */
+static void write_end(struct tree *tree)
+{
+    __atomic_store_n(&tree->version, tree->version + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * This function inserts data into the tree.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @param slot output if not NULL, the place of data in the tree
+ * @return 0 if successful, 1 if data was already present, -1 on failure
+ */
+static int insert_item(struct tree *tree, int data, const int **slot)
+{
+    int status;
+    STAT_START(tree);
+    if (tree->turbo == TREE_BTREE)
+    {
+        status = btree_insert(tree, data);
+        if (status >= 0 && slot != NULL)
+        {
+            struct bnode *leaf = btree_leaf(tree->btree, data);
+            *slot = &leaf->keys[bnode_rank(leaf, data)];
+        }
+    }
+    else if (tree->turbo == TREE_SPLAY)
+    {
+        //! the root holds data afterwards
+        status = splay_insert(tree, data);
+        if (status >= 0 && slot != NULL)
+        {
+            *slot = &tree->root->data;
+        }
+    }
+    //! plain and turbo trees find the spot and insert in the same pass
+    else
+    {
+        node *n = bst_insert(tree, data, &status);
+        if (n != NULL && slot != NULL)
+        {
+            *slot = &n->data;
+        }
+    }
+    STAT_STOP(tree, STAT_INSERT);
+    return status;
+}
+
+/**
+ * This function removes data from the tree.
+ *
+ * @param tree input tree
+ * @param data input data
+ * @return 0 if successful, 1 if data was not found, -1 on failure
+ */
+static int remove_item(struct tree *tree, int data)
+{
+    int status;
+    STAT_START(tree);
+    if (tree->turbo == TREE_BTREE)
+    {
+        status = btree_remove(tree, data);
+    }
+    else if (tree->turbo == TREE_SPLAY)
+    {
+        status = splay_remove(tree, data);
+    }
+    //! plain and turbo trees find and unlink the node in the same pass
+    else
+    {
+        status = bst_remove(tree, data);
+    }
+    STAT_STOP(tree, STAT_REMOVE);
+    return status;
+}
+
+/* Insert data into the tree. Return 0 if successful and -1 for
+ * failure. If the data is already in the tree it remains unchanged
+ * and 1 is returned. Snapshots can not be changed, they return -1. */
+int tree_insert(struct tree *tree, int data)
+{
+    //! if tree is NULL or a snapshot
+    if (tree == NULL || tree->origin != NULL)
+    {
+        return -1;
+    }
+    else if (!tree->concurrent)
+    {
+        return insert_item(tree, data, NULL);
+    }
+    write_begin(tree);
+    int status = insert_item(tree, data, NULL);
+    write_end(tree);
+    return status;
+}
+
+/* Insert data into the tree like tree_insert, or find it if it is already
+ * there, and return a pointer to the data in the tree. The status that
+ * tree_insert would return is stored in *status if status is not NULL. The
+ * pointer stays valid until the next change of the tree. Return NULL on
+ * failure. */
+const int *tree_insert_or_get(struct tree *tree, int data, int *status)
+{
+    const int *slot = NULL;
+    int result = -1;
+    if (tree != NULL && tree->origin == NULL)
+    {
+        if (tree->concurrent)
+        {
+            write_begin(tree);
+        }
+        result = insert_item(tree, data, &slot);
+        if (tree->concurrent)
+        {
+            write_end(tree);
+        }
+    }
+    if (status != NULL)
+    {
+        *status = result;
+    }
+    return result < 0 ? NULL : slot;
+}
+
+/* Remove data from the tree. Return 0 if successful.  If the data is
+ * not found 1 is returned. A turbo tree with snapshots copies nodes and
+ * returns -1 if that fails. Snapshots can not be changed, they return -1. */
+int tree_remove(struct tree *tree, int data)
+{
+    //! if tree is NULL
+    if (tree == NULL)
+    {
+        return 1;
+    }
+    else if (tree->origin != NULL)
+    {
+        return -1;
+    }
+    else if (!tree->concurrent)
+    {
+        return remove_item(tree, data);
+    }
+    write_begin(tree);
+    int status = remove_item(tree, data);
+    write_end(tree);
+    return status;
+}
+
+/* Return a read-only snapshot of a turbo tree, or NULL on failure. It takes
+ * constant time: the snapshot shares the nodes of the tree, and later
+ * changes of the tree copy the nodes they touch instead of changing them.
+ * tree_find, the iterator and the other calls that only read work on the
+ * snapshot, also while the tree is changed. Free it with tree_cleanup.
+ * Unless the tree is concurrent, taking and freeing snapshots must not run
+ * at the same time as a change of the tree. */
+struct tree *tree_snapshot(struct tree *tree)
+{
+    //! plain trees can be deep and B-tree nodes are big, copying their
+    //! paths would cost too much
+    if (tree == NULL || tree->turbo != TREE_AVL || tree->origin != NULL)
+    {
+        return NULL;
+    }
+    struct tree *snapshot = malloc(sizeof(struct tree));
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+    snapshot->turbo = tree->turbo;
+    snapshot->btree = NULL;
+    snapshot->slabs = NULL;
+    snapshot->slab_used = 0;
+    snapshot->free_list = NULL;
+    //! nothing changes the nodes of a snapshot, so readers need no lock
+    snapshot->concurrent = 0;
+    snapshot->version = 0;
+    snapshot->origin = tree;
+    snapshot->shared = 0;
+    snapshot->first_snapshot = NULL;
+    snapshot->last_snapshot = NULL;
+    snapshot->next_snapshot = NULL;
+    snapshot->retired = NULL;
+    snapshot->retired_count = 0;
+    snapshot->retired_size = 0;
+    snapshot->closed = 0;
+#ifdef TREE_STATS
+    memset(&snapshot->counters, 0, sizeof(struct tree_counters));
+#endif
+    if (tree->concurrent)
+    {
+        pthread_mutex_lock(&tree->lock);
+    }
+    snapshot->root = tree->root;
+    snapshot->generation = tree->generation;
+    //! the nodes that exist now are shared, later nodes are not
+    tree->shared = tree->generation++;
+    snapshot->prev_snapshot = tree->last_snapshot;
+    if (tree->last_snapshot != NULL)
+    {
+        tree->last_snapshot->next_snapshot = snapshot;
+    }
+    else
+    {
+        tree->first_snapshot = snapshot;
+    }
+    tree->last_snapshot = snapshot;
+    if (tree->concurrent)
+    {
+        pthread_mutex_unlock(&tree->lock);
+    }
+    return snapshot;
+}
+
+/**
+ * This function joins two AVL trees and a middle node into one AVL tree. All
+ * keys of lhs are less than the key of mid and all keys of rhs are greater.
+ * The middle node hangs from the spine of the higher tree at the height of
+ * the lower one, the spine is rebalanced on the way back up.
+ *
+ * @param lhs the left tree
+ * @param mid the middle node, its children are overwritten
+ * @param rhs the right tree
+ * @return the root of the joined tree
+ */
+static node *avl_join(node *lhs, node *mid, node *rhs)
+{
+    node **path[TREE_MAX_HEIGHT];
+    size_t depth = 0;
+    int lhs_height = node_height(lhs), rhs_height = node_height(rhs);
+    node *root;
+    node **link = &root;
+    if (lhs_height > rhs_height + 1)
+    {
+        //! follow the right spine of lhs down to the height of rhs
+        root = lhs;
+        while (node_height(*link) > rhs_height + 1)
+        {
+            path[depth++] = link;
+            link = &(*link)->rhs;
+        }
+        mid->lhs = *link;
+        mid->rhs = rhs;
+    }
+    else if (rhs_height > lhs_height + 1)
+    {
+        //! follow the left spine of rhs down to the height of lhs
+        root = rhs;
+        while (node_height(*link) > lhs_height + 1)
+        {
+            path[depth++] = link;
+            link = &(*link)->lhs;
+        }
+        mid->lhs = lhs;
+        mid->rhs = *link;
+    }
+    else
+    {
+        root = mid;
+        mid->lhs = lhs;
+        mid->rhs = rhs;
+    }
+    node_update(mid);
+    *link = mid;
+    //! every subtree on the spine got bigger, so none can be skipped
+    while (depth > 0)
+    {
+        rebalance(path[--depth]);
+    }
+    return root;
+}
+
+/**
+ * This function joins two AVL trees into one, all keys of lhs are less than
+ * the keys of rhs. The largest node of lhs becomes the middle node.
+ *
+ * @param lhs the left tree
+ * @param rhs the right tree
+ * @return the root of the joined tree
+ */
+static node *avl_join2(node *lhs, node *rhs)
+{
+    node **path[TREE_MAX_HEIGHT];
+    size_t depth = 0;
+    node **link = &lhs;
+    if (lhs == NULL)
+    {
+        return rhs;
+    }
+    while ((*link)->rhs != NULL)
+    {
+        path[depth++] = link;
+        link = &(*link)->rhs;
+    }
+    node *last = *link;
+    *link = last->lhs;
+    while (depth > 0)
+    {
+        rebalance(path[--depth]);
+    }
+    return avl_join(lhs, last, rhs);
+}
+
+/**
+ * This function splits an AVL tree into the keys less than key and the keys
+ * greater than key. The nodes on the way down to key are joined back into
+ * the two halves from the bottom up.
+ *
+ * @param root the tree
+ * @param key the key to split at
+ * @param lhs output, the tree with the keys less than key
+ * @param rhs output, the tree with the keys greater than key
+ * @return the node that contains key, or NULL if key is not in the tree
+ */
+static node *avl_split(node *root, int key, node **lhs, node **rhs)
+{
+    node *path[TREE_MAX_HEIGHT];
+    size_t depth = 0;
+    node *tmp = root;
+    while (tmp != NULL && tmp->data != key)
+    {
+        path[depth++] = tmp;
+        tmp = key < tmp->data ? tmp->lhs : tmp->rhs;
+    }
+    node *left = tmp != NULL ? tmp->lhs : NULL;
+    node *right = tmp != NULL ? tmp->rhs : NULL;
+    while (depth > 0)
+    {
+        node *parent = path[--depth];
+        if (key < parent->data)
+        {
+            right = avl_join(right, parent, parent->rhs);
+        }
+        else
+        {
+            left = avl_join(parent->lhs, parent, left);
+        }
+    }
+    *lhs = left;
+    *rhs = right;
+    return tmp;
+}
+
+/**
+ * Nodes that a set operation takes out of the trees, linked through lhs.
+ * Every task collects its own, so parallel tasks never share a list.
+ * @param head first node
+ * @param tail last node
+ */
+struct dropped
+{
+    node *head;
+    node *tail;
+};
+
+/* Helper function: Add a node to a list of dropped nodes. */
+static void drop_node(struct dropped *dropped, node *n)
+{
+    n->lhs = dropped->head;
+    dropped->head = n;
+    if (dropped->tail == NULL)
+    {
+        dropped->tail = n;
+    }
+}
+
+/* Helper function: Add all nodes of an AVL tree to a list of dropped nodes.
+ * The pending right children fit on a stack of the tree height. */
+static void drop_tree(struct dropped *dropped, node *root)
+{
+    node *stack[TREE_MAX_HEIGHT + 1];
+    size_t top = 0;
+    if (root != NULL)
+    {
+        stack[top++] = root;
+    }
+    while (top > 0)
+    {
+        node *tmp = stack[--top];
+        if (tmp->rhs != NULL)
+        {
+            stack[top++] = tmp->rhs;
+        }
+        if (tmp->lhs != NULL)
+        {
+            stack[top++] = tmp->lhs;
+        }
+        drop_node(dropped, tmp);
+    }
+}
+
+/* Helper function: Move all nodes of the list other to the list dropped. */
+static void drop_list(struct dropped *dropped, struct dropped *other)
+{
+    if (other->head == NULL)
+    {
+        return;
+    }
+    other->tail->lhs = dropped->head;
+    dropped->head = other->head;
+    if (dropped->tail == NULL)
+    {
+        dropped->tail = other->tail;
+    }
+}
+
+/* Set operations of tree_union, tree_intersect and tree_difference. */
+#define SET_UNION 0
+#define SET_INTERSECT 1
+#define SET_DIFFERENCE 2
+
+/**
+ * Half of a set operation that runs on its own thread.
+ * @param op the set operation
+ * @param a the first tree
+ * @param b the second tree
+ * @param threads number of threads this half may use
+ * @param result the root of the resulting tree
+ * @param dropped the nodes taken out by this half
+ */
+struct set_task
+{
+    int op;
+    node *a;
+    node *b;
+    long threads;
+    node *result;
+    struct dropped dropped;
+};
+
+static void *set_task_run(void *arg);
+
+/**
+ * This function combines two AVL trees with a set operation. The root of one
+ * tree splits the other tree, both halves are combined separately and the
+ * results are joined again. The left halves go to a new thread while there
+ * are threads to spare and enough work. The recursion follows one of the
+ * input trees, so it is never deeper than an AVL tree.
+ *
+ * @param op SET_UNION, SET_INTERSECT or SET_DIFFERENCE
+ * @param a the first tree
+ * @param b the second tree
+ * @param threads number of threads the operation may use
+ * @param dropped the list for nodes that are not in the result
+ * @return the root of the resulting tree
+ */
+static node *set_op(int op, node *a, node *b, long threads,
+                    struct dropped *dropped)
+{
+    if (a == NULL || b == NULL)
+    {
+        if (op == SET_UNION)
+        {
+            return a != NULL ? a : b;
+        }
+        else if (op == SET_INTERSECT)
+        {
+            drop_tree(dropped, a != NULL ? a : b);
+            return NULL;
+        }
+        drop_tree(dropped, b);
+        return a;
+    }
+    //! a difference keeps a, so the root of b splits a
+    node *pivot, *found, *a_lhs, *a_rhs, *b_lhs, *b_rhs;
+    if (op == SET_DIFFERENCE)
+    {
+        pivot = b;
+        b_lhs = b->lhs;
+        b_rhs = b->rhs;
+        found = avl_split(a, pivot->data, &a_lhs, &a_rhs);
+    }
+    else
+    {
+        pivot = a;
+        a_lhs = a->lhs;
+        a_rhs = a->rhs;
+        found = avl_split(b, pivot->data, &b_lhs, &b_rhs);
+    }
+    struct set_task task = {op, a_lhs, b_lhs, threads / 2, NULL, {NULL, NULL}};
+    pthread_t thread;
+    int forked = 0;
+    if (threads > 1 &&
+        node_size(a_lhs) + node_size(b_lhs) >= SET_PARALLEL_CUTOFF)
+    {
+        forked = pthread_create(&thread, NULL, set_task_run, &task) == 0;
+    }
+    if (!forked)
+    {
+        set_task_run(&task);
+    }
+    node *rhs = set_op(op, a_rhs, b_rhs, threads - threads / 2, dropped);
+    if (forked)
+    {
+        pthread_join(thread, NULL);
+    }
+    node *lhs = task.result;
+    drop_list(dropped, &task.dropped);
+    //! a key in both trees keeps the node of a
+    if (op == SET_UNION || (op == SET_INTERSECT && found != NULL))
+    {
+        if (found != NULL)
+        {
+            drop_node(dropped, found);
+        }
+        return avl_join(lhs, pivot, rhs);
     }
+    drop_node(dropped, pivot);
+    if (found != NULL)
+    {
+        drop_node(dropped, found);
+    }
+    return avl_join2(lhs, rhs);
+}
+
+/* Helper function: Run one half of a set operation. */
+static void *set_task_run(void *arg)
+{
+    struct set_task *task = arg;
+    task->result =
+        set_op(task->op, task->a, task->b, task->threads, &task->dropped);
     return NULL;
 }
 
 /**
- * This function deletes the root of the given tree.
+ * This function moves the arena of tree b to tree a and frees b. The unused
+ * end of the current slab of b, the free list of b and its retired nodes
+ * become free nodes of a, the slabs of b are added after the current slab
+ * of a. The generation of a is raised to that of b, so a later snapshot of
+ * a sees the nodes of b as shared as well.
  *
- * @param tree input tree
+ * @param a the tree that takes the nodes
+ * @param b the tree that is freed
  */
-void delete_root(struct tree *tree)
+static void tree_adopt(struct tree *a, struct tree *b)
 {
-    struct node *tmp = tree->root;
-    //! if root has no child, free the node and root points to NULL
-    if (tmp->lhs == NULL && tmp->rhs == NULL)
-    {
-        tree->root = NULL;
-        free(tmp);
-    }
-    //! if root has only right child
-    else if (tmp->lhs == NULL && tmp->rhs != NULL)
-    {
-        //! free the node and let right child be the root
-        tree->root = tmp->rhs;
-        tmp->rhs = NULL;
-        free(tmp);
-    }
-    //! if root has only left child
-    else if (tmp->rhs == NULL && tmp->lhs != NULL)
-    {
-        //! free the node and let left child be the root
-        tree->root = tmp->lhs;
-        tmp->lhs = NULL;
-        free(tmp);
-    }
-    //! else root has two childs
-    else
+    if (b->slabs != NULL)
     {
-        //! else the swap node is the most right child of the left subtree
-        struct node *swap_node = tmp->lhs;
-        while (swap_node->rhs != NULL)
+        for (size_t i = b->slab_used; i < b->slabs->size; i++)
+        {
+            free_node(a, &b->slabs->nodes[i]);
+        }
+        struct slab *last = b->slabs;
+        while (last->next != NULL)
         {
-            swap_node = swap_node->rhs;
+            last = last->next;
         }
-        //! parent of the swap node
-        struct node *parent = previous(tree, swap_node->data);
-        if (swap_node->lhs == NULL)
+        if (a->slabs != NULL)
         {
-            //! parent of swap node points to NULL if swap node has no child
-            parent->rhs = NULL;
+            last->next = a->slabs->next;
+            a->slabs->next = b->slabs;
         }
         else
         {
-            //! else points to the left child
-            parent->rhs = swap_node->lhs;
+            a->slabs = b->slabs;
+            a->slab_used = b->slabs->size;
         }
-        //! replace the node that has to be deleted with swap node
-        swap_node->lhs = tmp->lhs;
-        swap_node->rhs = tmp->rhs;
-        tree->root = swap_node;
-        tmp->lhs = NULL;
-        tmp->lhs = NULL;
-        //! free the node that has to be deleted
-        free(tmp);
     }
+    while (b->free_list != NULL)
+    {
+        node *tmp = b->free_list;
+        b->free_list = tmp->lhs;
+        free_node(a, tmp);
+    }
+    //! b has no snapshots left, so no one sees its retired nodes
+    for (size_t i = 0; i < b->retired_count; i++)
+    {
+        free_node(a, b->retired[i].n);
+    }
+    free(b->retired);
+    if (a->generation < b->generation)
+    {
+        a->generation = b->generation;
+    }
+    free(b);
 }
 
 /**
- * This function deletes the node that containst the data.
+ * This function combines two turbo trees with a set operation in parallel.
+ * The result goes to a, the nodes of b move to a and b is freed.
  *
- * @param tree input tree
+ * @param a the first tree
+ * @param b the second tree
+ * @param op SET_UNION, SET_INTERSECT or SET_DIFFERENCE
+ * @return 0 if successful, -1 if the trees can not be combined
  */
-void delete_node(struct tree *tree, int data)
+static int set_operation(struct tree *a, struct tree *b, int op)
 {
-    //! the parent of the node that has to be deleted
-    struct node *parent = previous(tree, data);
-    struct node *delete;
-    int i = 0;
-    //! if i = 0 it means the left child of the parent has to deleted
-    if (parent->lhs != NULL && parent->lhs->data == data)
+    if (a == NULL || b == NULL || a == b || a->turbo != TREE_AVL ||
+        b->turbo != TREE_AVL || a->concurrent || b->concurrent ||
+        a->origin != NULL || b->origin != NULL ||
+        a->first_snapshot != NULL || b->first_snapshot != NULL)
     {
-        delete = parent->lhs;
+        return -1;
     }
-    else
-    //! if i = 1 it means the right child of the parent has to deleted
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct dropped dropped = {NULL, NULL};
+    a->root = set_op(op, a->root, b->root, threads > 1 ? threads : 1, &dropped);
+    b->root = NULL;
+    tree_adopt(a, b);
+    if (dropped.head != NULL)
+    {
+        dropped.tail->lhs = a->free_list;
+        a->free_list = dropped.head;
+    }
+    return 0;
+}
+
+/* Add all items of tree b to tree a. Both must be turbo trees that are not
+ * concurrent and have no snapshots. The work is split over all cores. The
+ * nodes of b are reused by a and b is freed. Return 0 if successful, or -1
+ * if the trees can not be combined, in which case both are left
+ * unchanged. */
+int tree_union(struct tree *a, struct tree *b)
+{
+    return set_operation(a, b, SET_UNION);
+}
+
+/* Remove the items from tree a that are not in tree b, like tree_union. */
+int tree_intersect(struct tree *a, struct tree *b)
+{
+    return set_operation(a, b, SET_INTERSECT);
+}
+
+/* Remove the items from tree a that are in tree b, like tree_union. */
+int tree_difference(struct tree *a, struct tree *b)
+{
+    return set_operation(a, b, SET_DIFFERENCE);
+}
+
+/* Print the contents of the tree in sorted order to stdout. Print one
+ * item per line. */
+void tree_print(struct tree *tree)
+{
+    struct tree_iter *it = tree_iter_begin(tree);
+    int data;
+    while (tree_iter_next(it, &data) == 1)
+    {
+        printf("%d\n", data);
+    }
+    tree_iter_cleanup(it);
+}
+
+/* Call callback(data, arg) for every item from lo up to and including hi in
+ * sorted order. The scan stops early if the callback returns nonzero. In a
+ * turbo 2 tree the scan follows the linked leaves. Return the number of
+ * items passed to the callback or -1 on failure. */
+int tree_range(struct tree *tree, int lo, int hi,
+               int (*callback)(int data, void *arg), void *arg)
+{
+    int count = 0, data, status;
+    if (tree == NULL || callback == NULL)
     {
-        delete = parent->rhs;
-        i = 1;
+        return -1;
     }
-    //! if the node that has to be deleted has no child
-    if (delete->lhs == NULL && delete->rhs == NULL)
+    struct tree_iter *it = tree_iter_begin(tree);
+    if (it == NULL || tree_iter_seek(it, lo) != 0)
     {
-        //! if left child has to be deleted, left child points to NULL
-        if (i == 0)
-        {
-            parent->lhs = NULL;
-        }
-        //! else right child has to be deleted, right child points to NULL
-        else
+        tree_iter_cleanup(it);
+        return -1;
+    }
+    while ((status = tree_iter_next(it, &data)) == 1 && data <= hi)
+    {
+        count++;
+        if (callback(data, arg) != 0)
         {
-            parent->rhs = NULL;
+            break;
         }
     }
-    //! if the node that has to be deleted has only right child
-    else if (delete->lhs == NULL && delete->rhs != NULL)
+    tree_iter_cleanup(it);
+    return status < 0 ? -1 : count;
+}
+
+/* Return the number of items in the tree that are less than data. */
+size_t tree_rank(struct tree *tree, int data)
+{
+    size_t rank = 0;
+    if (tree == NULL)
+    {
+        return 0;
+    }
+    if (tree->turbo == TREE_BTREE)
     {
-        //! if left child has to be deleted
-        if (i == 0)
+        struct bnode *b = tree->btree;
+        if (b == NULL)
         {
-            //! left child of parent points to the right child of the child
-            parent->lhs = delete->rhs;
+            return 0;
         }
-        //! else right child has to be deleted
-        else
+        //! count the keys in the children left of the way down
+        while (!b->leaf)
         {
-            //! right child of parent points to the right child of the child
-            parent->rhs = delete->rhs;
+            int c = bnode_rank(b, data);
+            for (int i = 0; i < c; i++)
+            {
+                rank += b->child[i]->total;
+            }
+            b = b->child[c];
         }
-        delete->rhs = NULL;
+        return rank + (size_t)bnode_rank(b, data);
     }
-    //! if the node that has to be deleted has only left child
-    else if (delete->rhs == NULL && delete->lhs != NULL)
+    //! count the nodes left of the way down
+    for (node *tmp = tree->root; tmp != NULL;)
     {
-        //! if left child has to be deleted
-        if (i == 0)
+        if (data <= tmp->data)
         {
-            //! left child of parent points to the left child of the child
-            parent->lhs = delete->lhs;
+            tmp = tmp->lhs;
         }
-        //! else right child has to be deleted
         else
         {
-            //! right child of parent points to the right child of the child
-            parent->rhs = delete->lhs;
+            rank += node_size(tmp->lhs) + 1;
+            tmp = tmp->rhs;
         }
-        delete->lhs = NULL;
     }
-    //! else node that has to be deleted has two childs
-    else
+    return rank;
+}
+
+/* Store the item with rank k, the k-th smallest counting from 0, in *data.
+ * Return 0 if successful and 1 if the tree has no more than k items. */
+int tree_select(struct tree *tree, size_t k, int *data)
+{
+    if (tree == NULL || data == NULL)
+    {
+        return 1;
+    }
+    if (tree->turbo == TREE_BTREE)
     {
-        //! select the most right child of the left subtree
-        struct node *swap = delete->lhs;
-        while (swap->rhs != NULL)
+        struct bnode *b = tree->btree;
+        if (b == NULL || k >= b->total)
         {
-            swap = swap->rhs;
+            return 1;
         }
-        //! parent of the swap node
-        struct node *swap_parent = previous(tree, swap->data);
-        //! parent of swap node points to NULL if swap node has no child
-        if (swap->lhs == NULL)
+        //! skip the children that hold fewer than k keys together
+        while (!b->leaf)
         {
-            swap_parent->rhs = NULL;
+            int c = 0;
+            while (k >= b->child[c]->total)
+            {
+                k -= b->child[c++]->total;
+            }
+            b = b->child[c];
         }
-        //! else points to the left child
-        else
+        *data = b->keys[k];
+        return 0;
+    }
+    for (node *tmp = tree->root; tmp != NULL;)
+    {
+        size_t left = node_size(tmp->lhs);
+        if (k < left)
         {
-            swap_parent->rhs = swap->lhs;
+            tmp = tmp->lhs;
         }
-        //! replace the node that has to be deleted with swap node
-        swap->lhs = delete->lhs;
-        swap->rhs = delete->rhs;
-        delete->lhs = NULL;
-        delete->rhs = NULL;
-        //! if left child of parent has to be deleted
-        if (i == 0)
+        else if (k == left)
         {
-            //! left child of parent points to the swap node
-            parent->lhs = swap;
+            *data = tmp->data;
+            return 0;
         }
         else
         {
-            //! else right child of parent points to the swap node
-            parent->rhs = swap;
+            k -= left + 1;
+            tmp = tmp->rhs;
         }
     }
-    //! free the node that has to be deleted
-    free(delete);
+    return 1;
 }
 
-/**
- * This function print the data of the input node and nodes that belong to that
- * subtree in sorted order to stdout.
- *
- * @param node
- */
-void node_print(struct node *node)
-{
-    if (node != NULL)
-    {
-        node_print(node->lhs);
-        printf("%d\n", node->data);
-        node_print(node->rhs);
-    }
-}
-/**
- * This function free the input node and the nodes belong to that subtree
- *
- * @param node
- */
-void node_cleanup(struct node *node)
+/* Return the number of items from lo up to and including hi. */
+size_t tree_count_range(struct tree *tree, int lo, int hi)
 {
-    //! just free the node if it has no child
-    if (node->lhs == NULL && node->rhs == NULL)
+    if (tree == NULL || lo > hi)
     {
-        free(node);
-    }
-    //! free the node and node belong to that subtree
-    else if (node->lhs == NULL && node->rhs != NULL)
-    {
-        node_cleanup(node->rhs);
-        free(node);
+        return 0;
     }
-    //! free the node and node belong to that subtree
-    else if (node->rhs == NULL && node->lhs != NULL)
+    size_t below_hi;
+    //! the items up to hi are the items less than hi + 1
+    if (hi == INT_MAX)
     {
-        node_cleanup(node->lhs);
-        free(node);
+        below_hi = tree->turbo == TREE_BTREE
+                       ? (tree->btree == NULL ? 0 : tree->btree->total)
+                       : node_size(tree->root);
     }
-    //! free the node and node belong to that subtree
     else
     {
-        node_cleanup(node->lhs);
-        node_cleanup(node->rhs);
-        free(node);
+        below_hi = tree_rank(tree, hi + 1);
     }
+    return below_hi - tree_rank(tree, lo);
 }
 
-int tree_check(struct tree *tree)
+/* Helper function: Return 1 if the height and size of a node match its
+ * children and, in a turbo tree, the node is balanced. Return 0 if not. */
+static int node_valid(struct tree *tree, node *n)
 {
-    return 0;
+    int lhs = node_height(n->lhs), rhs = node_height(n->rhs);
+    if (n->size != node_size(n->lhs) + node_size(n->rhs) + 1)
+    {
+        return 0;
+    }
+    return tree->turbo != TREE_AVL ||
+           (n->height == (lhs > rhs ? lhs : rhs) + 1 && lhs - rhs <= 1 &&
+            rhs - lhs <= 1);
 }
 
-/* Return a pointer to a new tree. Return NULL on failure.
- * If the turbo flag is 0 the tree is initialized as a regular
- * binary search tree. If the turbo flag is 1 the tree is initialized
- * as a fast balanced binary search tree. */
-struct tree *tree_init(int turbo)
+/**
+ * This function checks a binary tree in order: the keys must increase and
+ * every node must be valid. A walk that meets more nodes than the root
+ * counts has found a loop and stops.
+ *
+ * @param tree input tree
+ * @return 0 if the tree is valid, 1 if it is broken, -1 on failure
+ */
+static int bst_check(struct tree *tree)
 {
-    if (turbo == 0)
+    size_t limit = node_size(tree->root), size = 64, top = 0, seen = 0;
+    node **stack = malloc(size * sizeof(node *));
+    node *tmp = tree->root, *last = NULL;
+    int status = 0;
+    if (stack == NULL)
     {
-        //! return NULL if malloc failed
-        struct tree *new_tree = malloc(sizeof(struct tree));
-        if (new_tree == NULL)
+        return -1;
+    }
+    while (status == 0 && (tmp != NULL || top > 0))
+    {
+        //! go down to the smallest key that is left
+        if (tmp != NULL)
         {
-            return NULL;
+            if (top == limit)
+            {
+                status = 1;
+                break;
+            }
+            else if (top == size)
+            {
+                node **grown = realloc(stack, 2 * size * sizeof(node *));
+                if (grown == NULL)
+                {
+                    status = -1;
+                    break;
+                }
+                stack = grown;
+                size *= 2;
+            }
+            stack[top++] = tmp;
+            tmp = tmp->lhs;
+            continue;
         }
-        new_tree->root = NULL;
-        //! return the new tree
-        return new_tree;
+        tmp = stack[--top];
+        if (++seen > limit || (last != NULL && last->data >= tmp->data) ||
+            !node_valid(tree, tmp))
+        {
+            status = 1;
+        }
+        last = tmp;
+        tmp = tmp->rhs;
     }
-    return NULL;
+    free(stack);
+    return status == 0 && seen != limit ? 1 : status;
 }
 
-/* Find data in the tree. Return 1 if the tree contains the data or
- * 0 if the data is not found. */
-int tree_find(struct tree *tree, int data)
+/**
+ * This function checks a B-tree level by level along the neighbour links.
+ * Every node must be as full as required, with sorted keys and INT_MAX in
+ * the unused slots, and hold the number of keys below it. The children of
+ * a level must form the next level in order, all leaves are on one level,
+ * the leaf keys increase along the links and every key of an inner node
+ * separates the keys of its two children.
+ *
+ * @param tree input tree
+ * @return 0 if the tree is valid, 1 if it is broken
+ */
+static int btree_check(struct tree *tree)
 {
-    //! if tree is NULL or the root is NULL
-    if (tree == NULL || tree->root == NULL)
+    struct bnode *level = tree->btree;
+    int last = 0, have_last = 0;
+    if (level == NULL)
     {
         return 0;
     }
-    struct node *tmp = tree->root;
-    //! search the node that contains the input data
-    while (tmp != NULL)
+    else if (level->count < 1 || level->next != NULL)
     {
-        if (tmp->data == data)
-        {
-            return 1;
-        }
-        else if (data < tmp->data)
+        return 1;
+    }
+    while (level != NULL)
+    {
+        struct bnode *below = level->leaf ? NULL : level->child[0];
+        size_t nodes = 0;
+        for (struct bnode *b = level; b != NULL; b = b->next)
         {
-            tmp = tmp->lhs;
+            //! there are fewer nodes on a level than keys in the tree
+            if (++nodes > tree->btree->total + 1 || b->leaf != level->leaf ||
+                b->count > BTREE_KEYS ||
+                (b != tree->btree && b->count < BTREE_MIN))
+            {
+                return 1;
+            }
+            for (int i = 0; i < BTREE_KEYS; i++)
+            {
+                if (i >= b->count ? b->keys[i] != INT_MAX
+                                  : i > 0 && b->keys[i] <= b->keys[i - 1])
+                {
+                    return 1;
+                }
+            }
+            size_t total = 0;
+            if (b->leaf)
+            {
+                if (have_last && b->keys[0] <= last)
+                {
+                    return 1;
+                }
+                last = b->keys[b->count - 1];
+                have_last = 1;
+                total = (size_t)b->count;
+            }
+            for (int i = 0; !b->leaf && i <= b->count; i++)
+            {
+                if (below == NULL || b->child[i] != below)
+                {
+                    return 1;
+                }
+                below = below->next;
+                total += b->child[i]->total;
+                //! the smallest key of the right child is the separator
+                //! and the largest key of the left child is below it
+                if (i < b->count)
+                {
+                    struct bnode *max = b->child[i];
+                    while (!max->leaf)
+                    {
+                        max = max->child[max->count];
+                    }
+                    if (btree_first(b->child[i + 1])->keys[0] < b->keys[i] ||
+                        max->keys[max->count - 1] >= b->keys[i])
+                    {
+                        return 1;
+                    }
+                }
+            }
+            if (b->total != total)
+            {
+                return 1;
+            }
         }
-        else
+        if (below != NULL)
         {
-            tmp = tmp->rhs;
+            return 1;
         }
+        level = level->leaf ? NULL : level->child[0];
     }
     return 0;
 }
 
-/* Insert data into the tree. Return 0 if successful and -1 for
- * failure. If the data is already in the tree it remains unchanged
- * and 1 is returned. */
-int tree_insert(struct tree *tree, int data)
+/* Check that the tree is consistent: the keys are in order, the subtree
+ * sizes and heights are right, turbo trees are balanced and B-tree nodes
+ * are linked and filled correctly. This walks the whole tree and is meant
+ * for debugging. Return 0 if the tree is valid, 1 if it is broken and -1
+ * on failure. */
+int tree_check(struct tree *tree)
 {
-    //! if tree is NULL
     if (tree == NULL)
     {
-        return -1;
-    }
-    //! if the the tree already containst the data
-    else if (tree_find(tree, data) == 1)
-    {
-        return 1;
+        return 0;
     }
-    //! make new node, return -1 on failure
-    struct node *new_node = make_node(data);
-    if (new_node == NULL)
+    else if (tree->turbo == TREE_BTREE)
     {
-        return -1;
+        return btree_check(tree);
     }
-    //! if the tree is empty, new node is the root
-    if (tree->root == NULL)
+    return bst_check(tree);
+}
+
+/**
+ * Node of a binary tree and its depth, on the stack of tree_stats.
+ * @param n the node
+ * @param depth the depth of the node, the root has depth 0
+ */
+struct depth_entry
+{
+    node *n;
+    size_t depth;
+};
+
+/* Print statistics of the tree to stderr: the number of items and nodes,
+ * the height, the average and maximum depth of an item (the root has depth
+ * 0) and a histogram of the number of items at every depth, the last
+ * column counts all deeper items. If the tree is compiled with TREE_STATS,
+ * it also prints the number of finds, inserts and removes with the average
+ * number of nodes each one visited, and the number of restructures:
+ * rotations, or splits, borrows and merges of B-tree nodes. */
+void tree_stats(struct tree *tree)
+{
+    size_t depths[TREE_MAX_HEIGHT] = {0};
+    size_t items = 0, nodes = 0, height = 0, depth_sum = 0;
+    if (tree == NULL)
     {
-        tree->root = new_node;
-        return 0;
+        return;
     }
-    struct node *tmp = tree->root;
-    //! find the right position to place the new node
-    while (1)
+    //! all keys of a B-tree are in the leaves, one level
+    if (tree->turbo == TREE_BTREE)
     {
-        //! search to left if data is less than the node
-        if (data < tmp->data)
+        for (struct bnode *level = tree->btree; level != NULL;
+             level = level->leaf ? NULL : level->child[0])
         {
-            //! place the node if left child is NULL
-            if (tmp->lhs == NULL)
-            {
-                tmp->lhs = new_node;
-                break;
-            }
-            else
+            for (struct bnode *b = level; b != NULL; b = b->next)
             {
-                tmp = tmp->lhs;
+                nodes++;
             }
+            height++;
         }
-        //! else search to right
-        else
+        items = tree->btree != NULL ? tree->btree->total : 0;
+        if (height > 0)
+        {
+            depths[height - 1 < TREE_MAX_HEIGHT ? height - 1
+                                                : TREE_MAX_HEIGHT - 1] = items;
+            depth_sum = items * (height - 1);
+        }
+    }
+    else
+    {
+        size_t size = 64, top = 0;
+        struct depth_entry *stack = malloc(size * sizeof(struct depth_entry));
+        if (stack == NULL)
+        {
+            return;
+        }
+        if (tree->root != NULL)
+        {
+            stack[top].n = tree->root;
+            stack[top++].depth = 0;
+        }
+        while (top > 0)
         {
-            //! place the node if right child is NULL
-            if (tmp->rhs == NULL)
+            struct depth_entry entry = stack[--top];
+            items++;
+            depth_sum += entry.depth;
+            depths[entry.depth < TREE_MAX_HEIGHT ? entry.depth
+                                                 : TREE_MAX_HEIGHT - 1]++;
+            if (entry.depth + 1 > height)
             {
-                tmp->rhs = new_node;
-                break;
+                height = entry.depth + 1;
             }
-            else
+            //! room for both children
+            if (top + 2 > size)
+            {
+                struct depth_entry *grown =
+                    realloc(stack, 2 * size * sizeof(struct depth_entry));
+                if (grown == NULL)
+                {
+                    free(stack);
+                    return;
+                }
+                stack = grown;
+                size *= 2;
+            }
+            node *child[2] = {entry.n->rhs, entry.n->lhs};
+            for (int i = 0; i < 2; i++)
             {
-                tmp = tmp->rhs;
+                if (child[i] != NULL)
+                {
+                    stack[top].n = child[i];
+                    stack[top++].depth = entry.depth + 1;
+                }
             }
         }
+        free(stack);
+        nodes = items;
     }
-    return 0;
+    fprintf(stderr, "stats items %zu nodes %zu height %zu depth %.2f %zu\n",
+            items, nodes, height, items > 0 ? (double)depth_sum / items : 0.0,
+            height > 0 ? height - 1 : 0);
+    fprintf(stderr, "stats depths");
+    for (size_t i = 0; i < height && i < TREE_MAX_HEIGHT; i++)
+    {
+        fprintf(stderr, " %zu", depths[i]);
+    }
+    fprintf(stderr, "\n");
+#ifdef TREE_STATS
+    const char *names[3] = {"find", "insert", "remove"};
+    fprintf(stderr, "stats");
+    for (int op = 0; op < 3; op++)
+    {
+        unsigned long ops = tree->counters.ops[op];
+        fprintf(stderr, " %s %lu %.2f", names[op], ops,
+                ops > 0 ? (double)tree->counters.visits[op] / ops : 0.0);
+    }
+    fprintf(stderr, " restructures %lu\n", tree->counters.restructures);
+#endif
 }
 
-/* Remove data from the tree. Return 0 if successful.  If the data is
- * not found 1 is returned. */
-int tree_remove(struct tree *tree, int data)
+/* Helper function: Free all memory of a tree that has no snapshots left. */
+static void tree_free(struct tree *tree)
 {
-    //! if tree is NULL
-    if (tree == NULL)
+    btree_cleanup(tree->btree);
+    //! the nodes live in the slabs, so free the slabs instead of the nodes
+    while (tree->slabs != NULL)
     {
-        return 1;
+        struct slab *tmp = tree->slabs;
+        tree->slabs = tmp->next;
+        free(tmp);
     }
-    //! if data is not found return 1
-    else if (tree_find(tree, data) == 0)
+    free(tree->retired);
+    if (tree->concurrent)
     {
-        return 1;
+        pthread_mutex_destroy(&tree->lock);
+    }
+    free(tree);
+}
+
+/**
+ * This function frees a snapshot. The retired nodes that no other snapshot
+ * can see go back to the tree, and if the tree was already cleaned up and
+ * this was its last snapshot, the tree is freed as well.
+ *
+ * @param snapshot the snapshot
+ */
+static void snapshot_cleanup(struct tree *snapshot)
+{
+    struct tree *tree = snapshot->origin;
+    if (tree->concurrent)
+    {
+        pthread_mutex_lock(&tree->lock);
     }
-    //! if root has to be removed, remove the root
-    if (tree->root->data == data)
+    if (snapshot->prev_snapshot != NULL)
     {
-        delete_root(tree);
+        snapshot->prev_snapshot->next_snapshot = snapshot->next_snapshot;
     }
-    //! else remove the node
     else
     {
-        delete_node(tree, data);
+        tree->first_snapshot = snapshot->next_snapshot;
+    }
+    if (snapshot->next_snapshot != NULL)
+    {
+        snapshot->next_snapshot->prev_snapshot = snapshot->prev_snapshot;
+    }
+    else
+    {
+        tree->last_snapshot = snapshot->prev_snapshot;
+    }
+    tree->shared =
+        tree->last_snapshot != NULL ? tree->last_snapshot->generation : 0;
+    reclaim_nodes(tree);
+    int last = tree->closed && tree->first_snapshot == NULL;
+    if (tree->concurrent)
+    {
+        pthread_mutex_unlock(&tree->lock);
+    }
+    free(snapshot);
+    if (last)
+    {
+        tree_free(tree);
     }
-    return 0;
-}
-
-/* Print the contents of the tree in sorted order to stdout. Print one
- * item per line. */
-void tree_print(struct tree *tree)
-{
-    node_print(tree->root);
 }
 
-/* Free all memory associated with the tree. */
+/* Free all memory associated with the tree. A tree with snapshots left is
+ * freed together with its last snapshot. */
 void tree_cleanup(struct tree *tree)
 {
-    if (tree != NULL)
+    if (tree == NULL)
     {
-        if (tree->root != NULL)
-        {
-            node_cleanup(tree->root);
-        }
-        free(tree);
+        return;
+    }
+    else if (tree->origin != NULL)
+    {
+        snapshot_cleanup(tree);
+        return;
+    }
+    if (tree->concurrent)
+    {
+        pthread_mutex_lock(&tree->lock);
+    }
+    //! the snapshots still use the nodes
+    int busy = tree->first_snapshot != NULL;
+    tree->closed = busy;
+    if (tree->concurrent)
+    {
+        pthread_mutex_unlock(&tree->lock);
+    }
+    if (!busy)
+    {
+        tree_free(tree);
     }
 }
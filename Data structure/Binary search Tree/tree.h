@@ -0,0 +1,74 @@
+/**
+ * tree.h:
+ * The ordered set of integers of tree.c: plain, AVL, B+-tree and splay
+ * trees behind one API, with iterators, order statistics, snapshots, frozen
+ * read-only copies, files and set operations.
+ *
+*/
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kinds of tree, selected with the turbo flag of tree_init. */
+#define TREE_PLAIN 0
+#define TREE_AVL 1
+#define TREE_BTREE 2
+#define TREE_SPLAY 3
+
+/* Flag that can be added to the turbo flag of tree_init to share a plain or
+ * AVL tree between threads. */
+#define TREE_CONCURRENT 8
+
+struct tree;
+struct node;
+struct tree_iter;
+struct frozen_tree;
+
+struct tree *tree_init(int turbo);
+struct tree *tree_build_sorted(const int *keys, size_t n);
+struct tree *tree_build(const int *keys, size_t n);
+int tree_find(struct tree *tree, int data);
+int tree_find_many(struct tree *tree, const int *keys, size_t n,
+                   uint8_t *out);
+int tree_insert(struct tree *tree, int data);
+const int *tree_insert_or_get(struct tree *tree, int data, int *status);
+int tree_remove(struct tree *tree, int data);
+void tree_print(struct tree *tree);
+void tree_dot(struct tree *tree, char *filename);
+int tree_check(struct tree *tree);
+void tree_stats(struct tree *tree);
+void tree_cleanup(struct tree *tree);
+
+struct node *previous(struct tree *tree, int data);
+void delete_root(struct tree *tree);
+void delete_node(struct tree *tree, int data);
+
+struct tree_iter *tree_iter_begin(struct tree *tree);
+int tree_iter_seek(struct tree_iter *it, int key);
+int tree_iter_next(struct tree_iter *it, int *data);
+void tree_iter_cleanup(struct tree_iter *it);
+int tree_range(struct tree *tree, int lo, int hi,
+               int (*callback)(int data, void *arg), void *arg);
+
+size_t tree_rank(struct tree *tree, int data);
+int tree_select(struct tree *tree, size_t k, int *data);
+size_t tree_count_range(struct tree *tree, int lo, int hi);
+
+struct tree *tree_snapshot(struct tree *tree);
+
+struct frozen_tree *tree_freeze(struct tree *tree);
+int frozen_find(const struct frozen_tree *frozen, int data);
+void frozen_cleanup(struct frozen_tree *frozen);
+
+int tree_save(struct tree *tree, const char *filename);
+struct frozen_tree *frozen_map(const char *filename);
+struct tree *tree_load(const char *filename);
+
+int tree_union(struct tree *a, struct tree *b);
+int tree_intersect(struct tree *a, struct tree *b);
+int tree_difference(struct tree *a, struct tree *b);
+
+#endif
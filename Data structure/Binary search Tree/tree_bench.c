@@ -0,0 +1,607 @@
+/**
+ * tree_bench.c:
+ * Benchmarks of tree.c. Run it as "tree_bench name [n]", where name selects
+ * one of the benchmarks in the table at the end and n overrides its number
+ * of keys. Without arguments it lists the benchmarks.
+ *
+*/
+
+/* clock_gettime is POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tree.h"
+
+/* Most keys a plain tree gets from a sorted stream, it degenerates into a
+ * list and every insert walks all of it. */
+#define BENCH_PLAIN_SORTED 40000
+
+/* Number of random lookups of the lookup benchmarks. */
+#define BENCH_LOOKUPS 5000000
+
+/* Most reader threads of the concurrent benchmark, and how long each run of
+ * it lasts in seconds. */
+#define BENCH_READERS 8
+#define BENCH_SECONDS 1.0
+
+/* Helper function: Return the time of a monotonic clock in seconds. */
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/* Helper function: Return the next number of a xorshift generator. */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * This function makes the keys 0 up to n - 1 in sorted, reverse sorted or
+ * random order.
+ *
+ * @param n number of keys
+ * @param order 0 for sorted, 1 for reverse sorted, 2 for random
+ * @param state state of the random generator
+ * @return the keys, NULL on failure
+ */
+static int *make_keys(size_t n, int order, uint64_t *state)
+{
+    int *keys = malloc((n > 0 ? n : 1) * sizeof(int));
+    if (keys == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i] = order == 1 ? (int)(n - 1 - i) : (int)i;
+    }
+    for (size_t i = n; order == 2 && i > 1; i--)
+    {
+        size_t j = next_random(state) % i;
+        int tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+    return keys;
+}
+
+/**
+ * This function inserts a sorted, a reverse sorted and a random stream of
+ * keys into a plain and an AVL tree, and then looks up as many random keys,
+ * which are all present. A plain tree gets at most BENCH_PLAIN_SORTED keys
+ * of a sorted stream.
+ *
+ * @param n number of keys
+ */
+static void bench_insert(size_t n)
+{
+    const char *orders[] = {"sorted", "reverse", "random"};
+    const char *kinds[] = {"plain", "avl"};
+    uint64_t state = 88172645463325252ULL;
+    for (int turbo = TREE_PLAIN; turbo <= TREE_AVL; turbo++)
+    {
+        for (int order = 0; order < 3; order++)
+        {
+            size_t size = n;
+            if (turbo == TREE_PLAIN && order < 2 && size > BENCH_PLAIN_SORTED)
+            {
+                size = BENCH_PLAIN_SORTED;
+            }
+            int *keys = make_keys(size, order, &state);
+            int *queries = make_keys(size, 2, &state);
+            struct tree *tree = tree_init(turbo);
+            if (keys == NULL || queries == NULL || tree == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            double start = now();
+            for (size_t i = 0; i < size; i++)
+            {
+                tree_insert(tree, keys[i]);
+            }
+            double middle = now();
+            size_t found = 0;
+            for (size_t i = 0; i < size; i++)
+            {
+                found += (size_t)tree_find(tree, queries[i]);
+            }
+            double end = now();
+            printf("%-6s %-8s %10zu keys  insert %8.3f s  find %8.3f s%s\n",
+                   kinds[turbo], orders[order], size, middle - start,
+                   end - middle, found == size ? "" : "  WRONG");
+            tree_cleanup(tree);
+            free(keys);
+            free(queries);
+        }
+    }
+}
+
+/**
+ * This function inserts n random keys into an AVL tree and frees it again.
+ * The nodes come from the slabs of the tree, so tree_cleanup frees a slab
+ * at a time instead of walking the tree.
+ *
+ * @param n number of keys
+ */
+static void bench_teardown(size_t n)
+{
+    uint64_t state = 88172645463325252ULL;
+    int *keys = make_keys(n, 2, &state);
+    struct tree *tree = tree_init(TREE_AVL);
+    if (keys == NULL || tree == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    double start = now();
+    for (size_t i = 0; i < n; i++)
+    {
+        tree_insert(tree, keys[i]);
+    }
+    double middle = now();
+    tree_cleanup(tree);
+    double end = now();
+    printf("%zu keys  insert %.3f s (%.2f Mops/s)  cleanup %.1f ms\n", n,
+           middle - start, (double)n / (middle - start) * 1e-6,
+           (end - middle) * 1e3);
+    free(keys);
+}
+
+/**
+ * This function compares tree_find on a balanced tree with frozen_find on
+ * the frozen copy of it, for BENCH_LOOKUPS random keys that are all
+ * present.
+ *
+ * @param n number of keys
+ */
+static void bench_frozen(size_t n)
+{
+    uint64_t state = 88172645463325252ULL;
+    int *keys = make_keys(n, 0, &state);
+    int *queries = malloc(BENCH_LOOKUPS * sizeof(int));
+    struct tree *tree = keys != NULL ? tree_build_sorted(keys, n) : NULL;
+    struct frozen_tree *frozen = tree != NULL ? tree_freeze(tree) : NULL;
+    if (queries == NULL || frozen == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        queries[i] = (int)(next_random(&state) % n);
+    }
+    size_t found = 0;
+    double start = now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        found += (size_t)tree_find(tree, queries[i]);
+    }
+    double middle = now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        found += (size_t)frozen_find(frozen, queries[i]);
+    }
+    double end = now();
+    printf("%zu keys  tree_find %.0f ns  frozen_find %.0f ns%s\n", n,
+           (middle - start) * 1e9 / BENCH_LOOKUPS,
+           (end - middle) * 1e9 / BENCH_LOOKUPS,
+           found == 2 * (size_t)BENCH_LOOKUPS ? "" : "  WRONG");
+    frozen_cleanup(frozen);
+    tree_cleanup(tree);
+    free(keys);
+    free(queries);
+}
+
+/**
+ * Thread of the concurrent benchmark
+ * @param tree the shared tree
+ * @param keys the tree holds the even keys below 2 * keys
+ * @param seed seed of the random generator
+ * @param end time the thread stops at
+ * @param ops lookups or changes done
+ */
+struct bench_thread
+{
+    struct tree *tree;
+    size_t keys;
+    uint64_t seed;
+    double end;
+    size_t ops;
+};
+
+/* Helper function: Look up random even keys until the end time, they are
+ * never removed so every lookup must succeed. */
+static void *bench_reader(void *arg)
+{
+    struct bench_thread *t = arg;
+    size_t found = 0;
+    do
+    {
+        for (int i = 0; i < 1024; i++)
+        {
+            int key = (int)(next_random(&t->seed) % t->keys) * 2;
+            found += (size_t)tree_find(t->tree, key);
+        }
+        t->ops += 1024;
+    } while (now() < t->end);
+    if (found != t->ops)
+    {
+        fprintf(stderr, "reader missed a key\n");
+        exit(1);
+    }
+    return NULL;
+}
+
+/* Helper function: Insert and remove random odd keys until the end time. */
+static void *bench_writer(void *arg)
+{
+    struct bench_thread *t = arg;
+    do
+    {
+        for (int i = 0; i < 1024; i++)
+        {
+            int key = (int)(next_random(&t->seed) % t->keys) * 2 + 1;
+            if (tree_insert(t->tree, key) != 1)
+            {
+                tree_remove(t->tree, key);
+            }
+        }
+        t->ops += 1024;
+    } while (now() < t->end);
+    return NULL;
+}
+
+/**
+ * This function runs 1 up to BENCH_READERS reader threads on a shared AVL
+ * tree of n keys made with TREE_CONCURRENT, first alone and then next to a
+ * writer thread, for BENCH_SECONDS each, and prints the lookups per second
+ * of all readers together.
+ *
+ * @param n number of keys
+ */
+static void bench_concurrent(size_t n)
+{
+    uint64_t state = 88172645463325252ULL;
+    int *keys = make_keys(n, 2, &state);
+    struct tree *tree = tree_init(TREE_AVL | TREE_CONCURRENT);
+    if (keys == NULL || tree == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        tree_insert(tree, keys[i] * 2);
+    }
+    for (int writers = 0; writers <= 1; writers++)
+    {
+        for (int readers = 1; readers <= BENCH_READERS; readers++)
+        {
+            struct bench_thread threads[BENCH_READERS + 1];
+            pthread_t ids[BENCH_READERS + 1];
+            double end = now() + BENCH_SECONDS;
+            for (int i = 0; i < readers + writers; i++)
+            {
+                threads[i] = (struct bench_thread){tree, n, state + i, end,
+                                                   0};
+                pthread_create(&ids[i], NULL,
+                               i < readers ? bench_reader : bench_writer,
+                               &threads[i]);
+            }
+            size_t lookups = 0;
+            for (int i = 0; i < readers + writers; i++)
+            {
+                pthread_join(ids[i], NULL);
+                lookups += i < readers ? threads[i].ops : 0;
+            }
+            printf("%d readers  %d writer  %8.2f Mlookups/s\n", readers,
+                   writers, (double)lookups / BENCH_SECONDS * 1e-6);
+        }
+    }
+    tree_cleanup(tree);
+    free(keys);
+}
+
+/**
+ * This function fills a plain, an AVL and a B+-tree with n random keys and
+ * looks up BENCH_LOOKUPS random present keys in each, with a loop of
+ * tree_find and with one call of tree_find_many.
+ *
+ * @param n number of keys
+ */
+static void bench_find_many(size_t n)
+{
+    const int turbos[] = {TREE_PLAIN, TREE_AVL, TREE_BTREE};
+    const char *kinds[] = {"plain", "avl", "btree"};
+    uint64_t state = 88172645463325252ULL;
+    int *keys = make_keys(n, 2, &state);
+    int *queries = malloc(BENCH_LOOKUPS * sizeof(int));
+    uint8_t *out = malloc(BENCH_LOOKUPS);
+    if (keys == NULL || queries == NULL || out == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        queries[i] = (int)(next_random(&state) % n);
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        struct tree *tree = tree_init(turbos[k]);
+        if (tree == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            tree_insert(tree, keys[i]);
+        }
+        size_t found = 0;
+        double start = now();
+        for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            found += (size_t)tree_find(tree, queries[i]);
+        }
+        double middle = now();
+        tree_find_many(tree, queries, BENCH_LOOKUPS, out);
+        double end = now();
+        for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            found += out[i];
+        }
+        printf("%-6s %zu keys  tree_find %.0f ns  tree_find_many %.0f ns%s\n",
+               kinds[k], n, (middle - start) * 1e9 / BENCH_LOOKUPS,
+               (end - middle) * 1e9 / BENCH_LOOKUPS,
+               found == 2 * (size_t)BENCH_LOOKUPS ? "" : "  WRONG");
+        tree_cleanup(tree);
+    }
+    free(keys);
+    free(queries);
+    free(out);
+}
+
+/**
+ * This function times tree_union of an AVL tree with the even keys below
+ * 2 * n and trees of n, n / 100 and n / 10000 keys spread over the same
+ * range, half of which are already in the first tree.
+ *
+ * @param n number of keys of the first tree
+ */
+static void bench_union(size_t n)
+{
+    const size_t parts[] = {1, 100, 10000};
+    for (int p = 0; p < 3; p++)
+    {
+        size_t m = n / parts[p];
+        size_t step = 2 * parts[p];
+        int *keys = malloc((n > 0 ? n : 1) * sizeof(int));
+        if (keys == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            keys[i] = (int)(2 * i);
+        }
+        struct tree *a = tree_build_sorted(keys, n);
+        for (size_t i = 0; i < m; i++)
+        {
+            keys[i] = (int)(i * step + (i & 1));
+        }
+        struct tree *b = tree_build_sorted(keys, m);
+        if (a == NULL || b == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        double start = now();
+        int status = tree_union(a, b);
+        double end = now();
+        size_t size = tree_count_range(a, 0, (int)(2 * n));
+        printf("%zu + %zu keys  union %.3f ms%s\n", n, m,
+               (end - start) * 1e3,
+               status == 0 && size == n + m / 2 ? "" : "  WRONG");
+        tree_cleanup(a);
+        free(keys);
+    }
+}
+
+/**
+ * This function makes BENCH_LOOKUPS queries over the keys 0 up to n - 1.
+ * Rank r of a random order of the keys is drawn with a Zipf weight of
+ * 1 / r^s, or with s = 0, 90% of the queries go to 1% of the keys.
+ *
+ * @param n number of keys
+ * @param s exponent of the Zipf distribution, 0 for the 90/1 split
+ * @param state state of the random generator
+ * @return the queries, NULL on failure
+ */
+static int *make_skewed(size_t n, double s, uint64_t *state)
+{
+    int *order = make_keys(n, 2, state);
+    double *cdf = malloc(n * sizeof(double));
+    int *queries = malloc(BENCH_LOOKUPS * sizeof(int));
+    if (order == NULL || cdf == NULL || queries == NULL)
+    {
+        free(order);
+        free(cdf);
+        free(queries);
+        return NULL;
+    }
+    double sum = 0;
+    for (size_t r = 0; r < n && s > 0; r++)
+    {
+        sum += 1 / pow((double)(r + 1), s);
+        cdf[r] = sum;
+    }
+    size_t hot = n / 100 > 0 ? n / 100 : 1;
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        double u = (double)(next_random(state) >> 11) / 9007199254740992.0;
+        size_t r;
+        if (s > 0)
+        {
+            //! first rank whose cumulative weight exceeds u * sum
+            size_t lo = 0, hi = n - 1;
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if (cdf[mid] > u * sum)
+                {
+                    hi = mid;
+                }
+                else
+                {
+                    lo = mid + 1;
+                }
+            }
+            r = lo;
+        }
+        else
+        {
+            r = next_random(state) % (u < 0.9 ? hot : n);
+        }
+        queries[i] = order[r];
+    }
+    free(order);
+    free(cdf);
+    return queries;
+}
+
+/**
+ * This function fills a plain, an AVL and a splay tree with n random keys
+ * and times BENCH_LOOKUPS skewed lookups with tree_find, for Zipf
+ * exponents 0.99 and 1.2 and for 90% of the lookups on 1% of the keys.
+ *
+ * @param n number of keys
+ */
+static void bench_skewed(size_t n)
+{
+    const int turbos[] = {TREE_PLAIN, TREE_AVL, TREE_SPLAY};
+    const double exponents[] = {0.99, 1.2, 0};
+    const char *kinds[] = {"plain", "avl", "splay"};
+    uint64_t state = 88172645463325252ULL;
+    int *keys = make_keys(n, 2, &state);
+    if (keys == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    for (int w = 0; w < 3; w++)
+    {
+        int *queries = make_skewed(n, exponents[w], &state);
+        if (queries == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        if (w < 2)
+        {
+            printf("%zu keys  zipf %.2f  ", n, exponents[w]);
+        }
+        else
+        {
+            printf("%zu keys  90%% on 1%%  ", n);
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            struct tree *tree = tree_init(turbos[k]);
+            if (tree == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                tree_insert(tree, keys[i]);
+            }
+            size_t found = 0;
+            double start = now();
+            for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+            {
+                found += (size_t)tree_find(tree, queries[i]);
+            }
+            double end = now();
+            printf("  %s %.0f ns%s", kinds[k],
+                   (end - start) * 1e9 / BENCH_LOOKUPS,
+                   found == BENCH_LOOKUPS ? "" : " WRONG");
+            tree_cleanup(tree);
+        }
+        printf("\n");
+        free(queries);
+    }
+    free(keys);
+}
+
+/**
+ * Benchmark
+ * @param name the name it is run with
+ * @param about what it measures
+ * @param keys default number of keys
+ * @param run the benchmark
+ */
+struct benchmark
+{
+    const char *name;
+    const char *about;
+    size_t keys;
+    void (*run)(size_t n);
+};
+
+static const struct benchmark benchmarks[] = {
+    {"insert", "sorted, reverse and random inserts and finds, plain and AVL",
+     10000000, bench_insert},
+    {"teardown", "random inserts into an AVL tree and tree_cleanup", 5000000,
+     bench_teardown},
+    {"frozen", "random lookups with tree_find and frozen_find", 10000000,
+     bench_frozen},
+    {"concurrent", "lookups of reader threads on a TREE_CONCURRENT tree",
+     1000000, bench_concurrent},
+    {"find_many", "random lookups with tree_find and tree_find_many", 1000000,
+     bench_find_many},
+    {"union", "tree_union of AVL trees of n and n, n / 100, n / 10000 keys",
+     4000000, bench_union},
+    {"skewed", "Zipf and 90/1 lookups in plain, AVL and splay trees", 1000000,
+     bench_skewed},
+};
+
+int main(int argc, char **argv)
+{
+    size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (size_t i = 0; argc > 1 && i < count; i++)
+    {
+        if (strcmp(argv[1], benchmarks[i].name) == 0)
+        {
+            size_t n = benchmarks[i].keys;
+            if (argc > 2)
+            {
+                n = (size_t)strtoul(argv[2], NULL, 10);
+            }
+            benchmarks[i].run(n);
+            return 0;
+        }
+    }
+    fprintf(stderr, "usage: %s name [n]\n", argv[0]);
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(stderr, "  %-10s %s, %zu keys\n", benchmarks[i].name,
+                benchmarks[i].about, benchmarks[i].keys);
+    }
+    return argc > 1;
+}
@@ -0,0 +1,202 @@
+/**
+ * tree_test.c:
+ * Regression tests for tree.c. Build it together with tree.c and run it,
+ * it prints "ok" if all tests pass. Built with -fsanitize=thread it also
+ * checks the concurrent trees for data races.
+ *
+*/
+
+/* rand_r is POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tree.h"
+
+#define TEST_KEYS 2000
+
+/* Number of lock-free readers next to the writer of a concurrent tree. */
+#define TEST_READERS 3
+
+/* Number of changes the writer of a concurrent tree makes. */
+#define TEST_CHANGES 100000
+
+/* File the save and load tests write. */
+#define TEST_FILE "tree_test.bin"
+
+/* Size of the header of a file of tree_save. */
+#define TEST_HEADER 64
+
+/* A union moves the nodes of b to a. Snapshots of b raised the generation
+ * of b, so a snapshot of a taken after the union must still see those nodes
+ * as shared and keep them when a changes. */
+static void test_union_then_snapshot(void)
+{
+    struct tree *a = tree_init(TREE_AVL);
+    struct tree *b = tree_init(TREE_AVL);
+    for (int i = 0; i < TEST_KEYS; i += 2)
+    {
+        assert(tree_insert(a, i) == 0);
+    }
+    for (int round = 0; round < 8; round++)
+    {
+        struct tree *snapshot = tree_snapshot(b);
+        assert(snapshot != NULL);
+        tree_cleanup(snapshot);
+    }
+    for (int i = 1; i < TEST_KEYS; i += 2)
+    {
+        assert(tree_insert(b, i) == 0);
+    }
+    assert(tree_union(a, b) == 0);
+    struct tree *snapshot = tree_snapshot(a);
+    assert(snapshot != NULL);
+    for (int i = 0; i < TEST_KEYS; i += 3)
+    {
+        assert(tree_remove(a, i) == 0);
+    }
+    for (int i = 0; i < TEST_KEYS; i++)
+    {
+        assert(tree_find(snapshot, i) == 1);
+        assert(tree_find(a, i) == (i % 3 != 0));
+    }
+    assert(tree_check(snapshot) == 0);
+    assert(tree_check(a) == 0);
+    tree_cleanup(snapshot);
+    tree_cleanup(a);
+}
+
+/**
+ * Struct reader
+ * @param tree the concurrent tree
+ * @param seed state of rand_r
+ * @param stop set by the writer when it is done
+ */
+struct reader
+{
+    struct tree *tree;
+    unsigned int seed;
+    int *stop;
+};
+
+/* Helper function: Look up keys that are always in the tree, as a thread. */
+static void *reader_run(void *arg)
+{
+    struct reader *reader = arg;
+    while (!__atomic_load_n(reader->stop, __ATOMIC_RELAXED))
+    {
+        int key = rand_r(&reader->seed) % TEST_KEYS * 2;
+        assert(tree_find(reader->tree, key) == 1);
+    }
+    return NULL;
+}
+
+/* The even keys stay in a concurrent tree while one writer inserts and
+ * removes odd keys, which rotates and reuses nodes under the readers. The
+ * readers must find every even key. */
+static void test_concurrent_readers(int turbo)
+{
+    struct tree *tree = tree_init(turbo | TREE_CONCURRENT);
+    assert(tree != NULL);
+    for (int i = 0; i < TEST_KEYS; i++)
+    {
+        assert(tree_insert(tree, i * 7919 % TEST_KEYS * 2) == 0);
+    }
+    int stop = 0;
+    pthread_t thread[TEST_READERS];
+    struct reader readers[TEST_READERS];
+    for (int i = 0; i < TEST_READERS; i++)
+    {
+        readers[i] = (struct reader){tree, (unsigned int)i + 1, &stop};
+        assert(pthread_create(&thread[i], NULL, reader_run, &readers[i]) == 0);
+    }
+    unsigned int seed = 42;
+    for (int i = 0; i < TEST_CHANGES; i++)
+    {
+        int key = rand_r(&seed) % TEST_KEYS * 2 + 1;
+        if (rand_r(&seed) & 1)
+        {
+            assert(tree_insert(tree, key) >= 0);
+        }
+        else
+        {
+            assert(tree_remove(tree, key) >= 0);
+        }
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < TEST_READERS; i++)
+    {
+        pthread_join(thread[i], NULL);
+    }
+    assert(tree_check(tree) == 0);
+    tree_cleanup(tree);
+}
+
+/* A B-tree is rebuilt bottom-up by tree_load. Sizes around the leaf and
+ * fan-out limits must give valid trees with every key. */
+static void test_load_btree(void)
+{
+    size_t sizes[] = {0, 1, 16, 17, 32, 33, 272, 273, 4625, 100000};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        struct tree *tree = tree_init(TREE_BTREE);
+        for (size_t i = 0; i < sizes[s]; i++)
+        {
+            assert(tree_insert(tree, (int)(i * 3)) == 0);
+        }
+        assert(tree_save(tree, TEST_FILE) == 0);
+        tree_cleanup(tree);
+        tree = tree_load(TEST_FILE);
+        assert(tree != NULL);
+        assert(tree_check(tree) == 0);
+        for (size_t i = 0; i < sizes[s] * 3; i++)
+        {
+            assert(tree_find(tree, (int)i) == (i % 3 == 0));
+        }
+        assert(tree_count_range(tree, 0, (int)(sizes[s] * 3)) == sizes[s]);
+        //! the loaded tree must still take changes
+        assert(tree_insert(tree, -1) == 0);
+        assert(tree_remove(tree, 0) == (sizes[s] > 0 ? 0 : 1));
+        assert(tree_check(tree) == 0);
+        tree_cleanup(tree);
+    }
+    remove(TEST_FILE);
+}
+
+/* A file with two keys swapped is not in Eytzinger order anymore, a search
+ * of it or a tree built from it would be wrong. */
+static void test_load_corrupt(void)
+{
+    struct tree *tree = tree_init(TREE_AVL);
+    for (int i = 0; i < TEST_KEYS; i++)
+    {
+        assert(tree_insert(tree, i) == 0);
+    }
+    assert(tree_save(tree, TEST_FILE) == 0);
+    tree_cleanup(tree);
+    FILE *file = fopen(TEST_FILE, "r+b");
+    assert(file != NULL);
+    int keys[2];
+    assert(fseek(file, TEST_HEADER + sizeof(int), SEEK_SET) == 0);
+    assert(fread(keys, sizeof(int), 2, file) == 2);
+    int swapped[2] = {keys[1], keys[0]};
+    assert(fseek(file, TEST_HEADER + sizeof(int), SEEK_SET) == 0);
+    assert(fwrite(swapped, sizeof(int), 2, file) == 2);
+    assert(fclose(file) == 0);
+    assert(frozen_map(TEST_FILE) == NULL);
+    assert(tree_load(TEST_FILE) == NULL);
+    remove(TEST_FILE);
+}
+
+int main(void)
+{
+    test_union_then_snapshot();
+    test_concurrent_readers(TREE_PLAIN);
+    test_concurrent_readers(TREE_AVL);
+    test_load_btree();
+    test_load_corrupt();
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,463 @@
+/**
+ * Header-only generator for ordered sets with any key type. DEFINE_TREE
+ * writes the types and functions of a turbo (AVL) tree for one key type,
+ * with the comparison inlined into every search: there is no function
+ * pointer call per comparison and no boxing of keys. It is the same tree as
+ * the turbo mode of tree.c, with the nodes carved from per-tree slabs,
+ * subtree sizes for rank and select, and insert and remove in a single
+ * descent.
+ *
+ *     DEFINE_TREE(i64_tree, int64_t, TREE_CMP_NUMBER)
+ *     DEFINE_TREE(str_tree, const char *, TREE_CMP_STRING)
+ *
+ * cmp(a, b) must return a negative number, 0 or a positive number when a is
+ * smaller than, equal to or larger than b. It can be a macro or a function,
+ * a static inline function is inlined like a macro. Keys are stored by
+ * value, so a tree of strings stores the pointers and the caller keeps the
+ * strings alive.
+ */
+#ifndef TYPED_TREE_H
+#define TYPED_TREE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Upper bound on the height of a tree, see TREE_MAX_HEIGHT in tree.c. */
+#define TYPED_TREE_MAX_HEIGHT 64
+
+/* Number of nodes carved from one slab of the node arena. */
+#define TYPED_TREE_SLAB 4096
+
+/* Comparison of numbers for DEFINE_TREE. Equality is tested first, so a
+ * search compiles to a compare, a branch on equality that is almost never
+ * taken and a conditional move, like a search written by hand. The form
+ * ((a) > (b)) - ((a) < (b)) made searches twice as slow. */
+#define TREE_CMP_NUMBER(a, b) ((a) == (b) ? 0 : (a) < (b) ? -1 : 1)
+
+/* Comparison of C strings for DEFINE_TREE. */
+#define TREE_CMP_STRING(a, b) strcmp((a), (b))
+
+/* Define the types and functions of a tree called name with keys of type
+ * key_type, ordered by cmp. */
+#define DEFINE_TREE(name, key_type, cmp)                                      \
+    TYPED_TREE_TYPES(name, key_type)                                          \
+    TYPED_TREE_ARENA(name, key_type)                                          \
+    TYPED_TREE_BALANCE(name)                                                  \
+    TYPED_TREE_OPS(name, key_type, cmp)
+
+/* No-op for the visit argument of TYPED_TREE_SEARCH. */
+#define TYPED_TREE_NO_VISIT(tree, n) ((void)(tree), (void)(n))
+
+/* Define a function fn that returns the node of tree that holds key, or NULL
+ * if there is none. The tree has the type tree_type and a member root, its
+ * nodes have the type node_type, the key in the member field and children
+ * lhs and rhs. visit(tree, 1) is evaluated for every node on the way, it
+ * lets tree.c count them. DEFINE_TREE and the plain and AVL trees of tree.c
+ * search with it. */
+#define TYPED_TREE_SEARCH(fn, tree_type, node_type, key_type, field, cmp,     \
+                          visit)                                              \
+static inline node_type *fn(tree_type *tree, key_type key)                    \
+{                                                                             \
+    node_type *tmp = tree->root;                                              \
+    while (tmp != NULL)                                                       \
+    {                                                                         \
+        visit(tree, 1);                                                       \
+        int order = cmp(key, tmp->field);                                     \
+        if (order == 0)                                                       \
+        {                                                                     \
+            return tmp;                                                       \
+        }                                                                     \
+        tmp = order < 0 ? tmp->lhs : tmp->rhs;                                \
+    }                                                                         \
+    return NULL;                                                              \
+}
+
+/* Types of DEFINE_TREE. */
+#define TYPED_TREE_TYPES(name, key_type)                                      \
+/* Node with the key, the height and size of its subtree and children. */     \
+struct name##_node                                                            \
+{                                                                             \
+    key_type key;                                                             \
+    int height;                                                               \
+    size_t size;                                                              \
+    struct name##_node *lhs;                                                  \
+    struct name##_node *rhs;                                                  \
+};                                                                            \
+/* Slab of nodes owned by a single tree. */                                   \
+struct name##_slab                                                            \
+{                                                                             \
+    struct name##_slab *next;                                                 \
+    size_t size;                                                              \
+    struct name##_node nodes[];                                               \
+};                                                                            \
+/* Tree with its node arena. */                                               \
+struct name                                                                   \
+{                                                                             \
+    struct name##_node *root;                                                 \
+    struct name##_slab *slabs;                                                \
+    size_t slab_used;                                                         \
+    struct name##_node *free_list;                                            \
+};
+
+/* Allocation functions of DEFINE_TREE. */
+#define TYPED_TREE_ARENA(name, key_type)                                      \
+/* Return a pointer to a new empty tree, or NULL on failure. */               \
+static inline struct name *name##_init(void)                                  \
+{                                                                             \
+    struct name *tree = malloc(sizeof(struct name));                          \
+    if (tree == NULL)                                                         \
+    {                                                                         \
+        return NULL;                                                          \
+    }                                                                         \
+    tree->root = NULL;                                                        \
+    tree->slabs = NULL;                                                       \
+    tree->slab_used = 0;                                                      \
+    tree->free_list = NULL;                                                   \
+    return tree;                                                              \
+}                                                                             \
+/* Free all memory of the tree, the slabs hold all nodes. */                  \
+static inline void name##_cleanup(struct name *tree)                          \
+{                                                                             \
+    if (tree == NULL)                                                         \
+    {                                                                         \
+        return;                                                               \
+    }                                                                         \
+    while (tree->slabs != NULL)                                               \
+    {                                                                         \
+        struct name##_slab *tmp = tree->slabs;                                \
+        tree->slabs = tmp->next;                                              \
+        free(tmp);                                                            \
+    }                                                                         \
+    free(tree);                                                               \
+}                                                                             \
+/* Helper function: Allocate a node for key from the arena of the tree.       \
+ * Return NULL on failure. */                                                 \
+static inline struct name##_node *name##_make_node(struct name *tree,         \
+                                                   key_type key)              \
+{                                                                             \
+    struct name##_node *n = tree->free_list;                                  \
+    if (n != NULL)                                                            \
+    {                                                                         \
+        tree->free_list = n->lhs;                                             \
+    }                                                                         \
+    else                                                                      \
+    {                                                                         \
+        if (tree->slabs == NULL || tree->slab_used == tree->slabs->size)      \
+        {                                                                     \
+            struct name##_slab *slab = malloc(                                \
+                sizeof(struct name##_slab) +                                  \
+                TYPED_TREE_SLAB * sizeof(struct name##_node));                \
+            if (slab == NULL)                                                 \
+            {                                                                 \
+                return NULL;                                                  \
+            }                                                                 \
+            slab->size = TYPED_TREE_SLAB;                                     \
+            slab->next = tree->slabs;                                         \
+            tree->slabs = slab;                                               \
+            tree->slab_used = 0;                                              \
+        }                                                                     \
+        n = &tree->slabs->nodes[tree->slab_used++];                           \
+    }                                                                         \
+    n->key = key;                                                             \
+    n->height = 1;                                                            \
+    n->size = 1;                                                              \
+    n->lhs = NULL;                                                            \
+    n->rhs = NULL;                                                            \
+    return n;                                                                 \
+}
+
+/* Balancing functions of DEFINE_TREE, they do not depend on the key. */
+#define TYPED_TREE_BALANCE(name)                                              \
+/* Helper function: Return the height of the subtree, 0 for an empty one. */  \
+static inline int name##_height(const struct name##_node *n)                  \
+{                                                                             \
+    return n == NULL ? 0 : n->height;                                         \
+}                                                                             \
+/* Return the number of keys in the subtree. */                               \
+static inline size_t name##_node_size(const struct name##_node *n)            \
+{                                                                             \
+    return n == NULL ? 0 : n->size;                                           \
+}                                                                             \
+/* Helper function: Recompute the height and size of a node. */               \
+static inline void name##_update(struct name##_node *n)                       \
+{                                                                             \
+    int lhs = name##_height(n->lhs);                                          \
+    int rhs = name##_height(n->rhs);                                          \
+    n->height = (lhs > rhs ? lhs : rhs) + 1;                                  \
+    n->size = name##_node_size(n->lhs) + name##_node_size(n->rhs) + 1;        \
+}                                                                             \
+/* Helper function: Rotate the subtree at *link to the left. */               \
+static inline void name##_rotate_left(struct name##_node **link)              \
+{                                                                             \
+    struct name##_node *tmp = *link;                                          \
+    struct name##_node *child = tmp->rhs;                                     \
+    tmp->rhs = child->lhs;                                                    \
+    child->lhs = tmp;                                                         \
+    name##_update(tmp);                                                       \
+    name##_update(child);                                                     \
+    *link = child;                                                            \
+}                                                                             \
+/* Helper function: Rotate the subtree at *link to the right. */              \
+static inline void name##_rotate_right(struct name##_node **link)             \
+{                                                                             \
+    struct name##_node *tmp = *link;                                          \
+    struct name##_node *child = tmp->lhs;                                     \
+    tmp->lhs = child->rhs;                                                    \
+    child->rhs = tmp;                                                         \
+    name##_update(tmp);                                                       \
+    name##_update(child);                                                     \
+    *link = child;                                                            \
+}                                                                             \
+/* Helper function: Restore the balance of the subtree at *link. */           \
+static inline void name##_rebalance(struct name##_node **link)                \
+{                                                                             \
+    struct name##_node *tmp = *link;                                          \
+    int balance = name##_height(tmp->lhs) - name##_height(tmp->rhs);          \
+    if (balance > 1)                                                          \
+    {                                                                         \
+        if (name##_height(tmp->lhs->lhs) < name##_height(tmp->lhs->rhs))      \
+        {                                                                     \
+            name##_rotate_left(&tmp->lhs);                                    \
+        }                                                                     \
+        name##_rotate_right(link);                                            \
+    }                                                                         \
+    else if (balance < -1)                                                    \
+    {                                                                         \
+        if (name##_height(tmp->rhs->rhs) < name##_height(tmp->rhs->lhs))      \
+        {                                                                     \
+            name##_rotate_right(&tmp->rhs);                                   \
+        }                                                                     \
+        name##_rotate_left(link);                                             \
+    }                                                                         \
+    else                                                                      \
+    {                                                                         \
+        name##_update(tmp);                                                   \
+    }                                                                         \
+}                                                                             \
+/* Helper function: Fix the sizes on the path by delta and rebalance it       \
+ * bottom-up, the heights stop changing at some point but the sizes do        \
+ * not. */                                                                    \
+static inline void name##_fix_path(struct name##_node ***path, size_t depth,  \
+                                   int delta)                                 \
+{                                                                             \
+    int balanced = 0;                                                         \
+    while (depth > 0)                                                         \
+    {                                                                         \
+        struct name##_node **link = path[--depth];                            \
+        (*link)->size += (size_t)delta;                                       \
+        if (!balanced)                                                        \
+        {                                                                     \
+            int old_height = (*link)->height;                                 \
+            name##_rebalance(link);                                           \
+            balanced = (*link)->height == old_height;                         \
+        }                                                                     \
+    }                                                                         \
+}
+
+/* Search and change functions of DEFINE_TREE. */
+#define TYPED_TREE_OPS(name, key_type, cmp)                                   \
+TYPED_TREE_SEARCH(name##_search, const struct name, struct name##_node,       \
+                  key_type, key, cmp, TYPED_TREE_NO_VISIT)                    \
+/* Return a pointer to the key in the tree that is equal to key, or NULL if   \
+ * there is none. The pointer is valid until key is removed. */               \
+static inline key_type *name##_find(const struct name *tree, key_type key)    \
+{                                                                             \
+    struct name##_node *n = name##_search(tree, key);                         \
+    return n == NULL ? NULL : &n->key;                                        \
+}                                                                             \
+/* Insert key into the tree, or find the key that is equal to it, and         \
+ * return a pointer to the key in the tree. If status is not NULL, *status    \
+ * is set to 0 if key was inserted, 1 if it was already present and -1 on     \
+ * failure, where NULL is returned. */                                        \
+static inline key_type *name##_insert_or_get(struct name *tree, key_type key, \
+                                          int *status)                        \
+{                                                                             \
+    struct name##_node **path[TYPED_TREE_MAX_HEIGHT];                         \
+    size_t depth = 0;                                                         \
+    struct name##_node **link = &tree->root;                                  \
+    while (*link != NULL)                                                     \
+    {                                                                         \
+        int order = cmp(key, (*link)->key);                                   \
+        if (order == 0)                                                       \
+        {                                                                     \
+            if (status != NULL)                                               \
+            {                                                                 \
+                *status = 1;                                                  \
+            }                                                                 \
+            return &(*link)->key;                                             \
+        }                                                                     \
+        path[depth++] = link;                                                 \
+        link = order < 0 ? &(*link)->lhs : &(*link)->rhs;                     \
+    }                                                                         \
+    struct name##_node *n = name##_make_node(tree, key);                      \
+    if (n == NULL)                                                            \
+    {                                                                         \
+        if (status != NULL)                                                   \
+        {                                                                     \
+            *status = -1;                                                     \
+        }                                                                     \
+        return NULL;                                                          \
+    }                                                                         \
+    *link = n;                                                                \
+    name##_fix_path(path, depth, 1);                                          \
+    if (status != NULL)                                                       \
+    {                                                                         \
+        *status = 0;                                                          \
+    }                                                                         \
+    return &n->key;                                                           \
+}                                                                             \
+/* Insert key into the tree. Return 0 if successful, 1 if an equal key was    \
+ * already present and -1 on failure. */                                      \
+static inline int name##_insert(struct name *tree, key_type key)              \
+{                                                                             \
+    int status;                                                               \
+    name##_insert_or_get(tree, key, &status);                                 \
+    return status;                                                            \
+}                                                                             \
+/* Remove the key that is equal to key from the tree. Return 0 if             \
+ * successful and 1 if there is no such key. */                               \
+static inline int name##_remove(struct name *tree, key_type key)              \
+{                                                                             \
+    struct name##_node **path[TYPED_TREE_MAX_HEIGHT];                         \
+    size_t depth = 0;                                                         \
+    struct name##_node **link = &tree->root;                                  \
+    int order;                                                                \
+    while (*link != NULL && (order = cmp(key, (*link)->key)) != 0)            \
+    {                                                                         \
+        path[depth++] = link;                                                 \
+        link = order < 0 ? &(*link)->lhs : &(*link)->rhs;                     \
+    }                                                                         \
+    if (*link == NULL)                                                        \
+    {                                                                         \
+        return 1;                                                             \
+    }                                                                         \
+    struct name##_node *delete = *link;                                       \
+    if (delete->lhs == NULL || delete->rhs == NULL)                           \
+    {                                                                         \
+        *link = delete->lhs != NULL ? delete->lhs : delete->rhs;              \
+    }                                                                         \
+    /* else the most right node of the left subtree takes its place */        \
+    else                                                                      \
+    {                                                                         \
+        size_t delete_depth = depth;                                          \
+        path[depth++] = link;                                                 \
+        struct name##_node **swap_link = &delete->lhs;                        \
+        while ((*swap_link)->rhs != NULL)                                     \
+        {                                                                     \
+            path[depth++] = swap_link;                                        \
+            swap_link = &(*swap_link)->rhs;                                   \
+        }                                                                     \
+        struct name##_node *swap = *swap_link;                                \
+        *swap_link = swap->lhs;                                               \
+        swap->lhs = delete->lhs;                                              \
+        swap->rhs = delete->rhs;                                              \
+        swap->height = delete->height;                                        \
+        swap->size = delete->size;                                            \
+        *link = swap;                                                         \
+        if (depth > delete_depth + 1)                                         \
+        {                                                                     \
+            path[delete_depth + 1] = &swap->lhs;                              \
+        }                                                                     \
+    }                                                                         \
+    delete->lhs = tree->free_list;                                            \
+    tree->free_list = delete;                                                 \
+    name##_fix_path(path, depth, -1);                                         \
+    return 0;                                                                 \
+}                                                                             \
+/* Return the number of keys in the tree. */                                  \
+static inline size_t name##_size(const struct name *tree)                     \
+{                                                                             \
+    return name##_node_size(tree->root);                                      \
+}                                                                             \
+/* Return the number of keys in the tree that are smaller than key. */        \
+static inline size_t name##_rank(const struct name *tree, key_type key)       \
+{                                                                             \
+    size_t rank = 0;                                                          \
+    struct name##_node *tmp = tree->root;                                     \
+    while (tmp != NULL)                                                       \
+    {                                                                         \
+        int order = cmp(key, tmp->key);                                       \
+        if (order < 0)                                                        \
+        {                                                                     \
+            tmp = tmp->lhs;                                                   \
+        }                                                                     \
+        else if (order > 0)                                                   \
+        {                                                                     \
+            rank += name##_node_size(tmp->lhs) + 1;                           \
+            tmp = tmp->rhs;                                                   \
+        }                                                                     \
+        else                                                                  \
+        {                                                                     \
+            return rank + name##_node_size(tmp->lhs);                         \
+        }                                                                     \
+    }                                                                         \
+    return rank;                                                              \
+}                                                                             \
+/* Return a pointer to the k-th smallest key of the tree, counting from 0,    \
+ * or NULL if the tree has k keys or fewer. */                                \
+static inline key_type *name##_select(const struct name *tree, size_t k)      \
+{                                                                             \
+    struct name##_node *tmp = tree->root;                                     \
+    while (tmp != NULL)                                                       \
+    {                                                                         \
+        size_t left = name##_node_size(tmp->lhs);                             \
+        if (k < left)                                                         \
+        {                                                                     \
+            tmp = tmp->lhs;                                                   \
+        }                                                                     \
+        else if (k > left)                                                    \
+        {                                                                     \
+            k -= left + 1;                                                    \
+            tmp = tmp->rhs;                                                   \
+        }                                                                     \
+        else                                                                  \
+        {                                                                     \
+            return &tmp->key;                                                 \
+        }                                                                     \
+    }                                                                         \
+    return NULL;                                                              \
+}                                                                             \
+/* Return a pointer to the smallest key of the tree that is not smaller than  \
+ * key, or NULL if there is none. */                                          \
+static inline key_type *name##_lower_bound(const struct name *tree,           \
+                                      key_type key)                           \
+{                                                                             \
+    struct name##_node *tmp = tree->root, *found = NULL;                      \
+    while (tmp != NULL)                                                       \
+    {                                                                         \
+        if (cmp(key, tmp->key) <= 0)                                          \
+        {                                                                     \
+            found = tmp;                                                      \
+            tmp = tmp->lhs;                                                   \
+        }                                                                     \
+        else                                                                  \
+        {                                                                     \
+            tmp = tmp->rhs;                                                   \
+        }                                                                     \
+    }                                                                         \
+    return found != NULL ? &found->key : NULL;                                \
+}                                                                             \
+/* Return a pointer to the smallest key of the tree that is larger than key,  \
+ * or NULL if there is none. Together with lower_bound this walks the keys    \
+ * in order: for (p = lower_bound(t, lo); p; p = upper_bound(t, *p)). */      \
+static inline key_type *name##_upper_bound(const struct name *tree,           \
+                                      key_type key)                           \
+{                                                                             \
+    struct name##_node *tmp = tree->root, *found = NULL;                      \
+    while (tmp != NULL)                                                       \
+    {                                                                         \
+        if (cmp(key, tmp->key) < 0)                                           \
+        {                                                                     \
+            found = tmp;                                                      \
+            tmp = tmp->lhs;                                                   \
+        }                                                                     \
+        else                                                                  \
+        {                                                                     \
+            tmp = tmp->rhs;                                                   \
+        }                                                                     \
+    }                                                                         \
+    return found != NULL ? &found->key : NULL;                                \
+}
+
+#endif
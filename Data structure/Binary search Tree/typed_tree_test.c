@@ -0,0 +1,110 @@
+/**
+ * typed_tree_test.c:
+ * Regression tests for typed_tree.h. Trees made with DEFINE_TREE are run
+ * side by side with the turbo tree of tree.c, so the two implementations
+ * can not drift apart. Build it together with tree.c and run it, it prints
+ * "ok" if all tests pass.
+ *
+*/
+
+/* rand_r is POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tree.h"
+#include "typed_tree.h"
+
+/* Keys are drawn from 0 up to this number. */
+#define TEST_RANGE 5000
+
+/* Number of random operations of a test. */
+#define TEST_STEPS 200000
+
+DEFINE_TREE(itree, int, TREE_CMP_NUMBER)
+DEFINE_TREE(dtree, double, TREE_CMP_NUMBER)
+
+/* Helper function: Check the order, the AVL balance, the heights and the
+ * sizes of a subtree of a dtree with keys between lo and hi. Return the
+ * height of the subtree. */
+static int check_dnode(const struct dtree_node *n, double lo, double hi)
+{
+    if (n == NULL)
+    {
+        return 0;
+    }
+    assert(n->key > lo && n->key < hi);
+    int lhs = check_dnode(n->lhs, lo, n->key);
+    int rhs = check_dnode(n->rhs, n->key, hi);
+    assert(lhs - rhs <= 1 && rhs - lhs <= 1);
+    assert(n->height == (lhs > rhs ? lhs : rhs) + 1);
+    assert(n->size ==
+           dtree_node_size(n->lhs) + dtree_node_size(n->rhs) + 1);
+    return n->height;
+}
+
+/* A dtree with the keys k / 2 and an itree with the keys k follow the same
+ * random inserts, finds and removes as a turbo tree of tree.c with the keys
+ * k. Every result, the size and the order statistics must agree. */
+static void test_against_tree(void)
+{
+    struct tree *ref = tree_init(TREE_AVL);
+    struct itree *it = itree_init();
+    struct dtree *dt = dtree_init();
+    assert(ref != NULL && it != NULL && dt != NULL);
+    unsigned int seed = 16;
+    for (int step = 0; step < TEST_STEPS; step++)
+    {
+        int k = rand_r(&seed) % TEST_RANGE;
+        double d = k / 2.0;
+        int status, expected;
+        switch (rand_r(&seed) % 4)
+        {
+        case 0:
+            expected = tree_insert(ref, k);
+            assert(itree_insert(it, k) == expected);
+            assert(dtree_insert(dt, d) == expected);
+            break;
+        case 1:
+            expected = tree_find(ref, k);
+            assert((itree_find(it, k) != NULL) == expected);
+            assert((dtree_find(dt, d) != NULL) == expected);
+            break;
+        case 2:
+            expected = tree_remove(ref, k);
+            assert(itree_remove(it, k) == expected);
+            assert(dtree_remove(dt, d) == expected);
+            break;
+        default:
+            assert(*tree_insert_or_get(ref, k, &expected) == k);
+            assert(*itree_insert_or_get(it, k, &status) == k);
+            assert(status == expected);
+            //! status is optional
+            assert(*dtree_insert_or_get(dt, d, NULL) == d);
+            break;
+        }
+    }
+    size_t size = tree_count_range(ref, 0, TEST_RANGE);
+    assert(itree_size(it) == size && dtree_size(dt) == size);
+    check_dnode(dt->root, -1, TEST_RANGE);
+    for (size_t i = 0; i < size; i++)
+    {
+        int key;
+        assert(tree_select(ref, i, &key) == 0);
+        assert(*itree_select(it, i) == key);
+        assert(*dtree_select(dt, i) == key / 2.0);
+        assert(dtree_rank(dt, key / 2.0) == tree_rank(ref, key));
+    }
+    assert(dtree_select(dt, size) == NULL);
+    tree_cleanup(ref);
+    itree_cleanup(it);
+    dtree_cleanup(dt);
+}
+
+int main(void)
+{
+    test_against_tree();
+    puts("ok");
+    return 0;
+}
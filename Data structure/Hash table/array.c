@@ -10,21 +10,57 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include "array.h"
 
+/* Number of values an array keeps in its own struct, before it needs a
+ * buffer on the heap. */
+#define ARRAY_LOCAL 4
+
 /**
  * struct array
- * @param array 1D array that contains values
+ * @param array 1D array that contains values, local or a buffer on the heap
  * @param element numbers of elements stored
  * @param array_size size of array
+ * @param local room for the first ARRAY_LOCAL values
  */
 struct array
 {
     int *array;
     size_t elements;
     size_t array_size;
+    int local[ARRAY_LOCAL];
 };
 
+/**
+ * This function returns the number of bytes of a struct array, for callers
+ * that keep one inside a block of their own with array_init_at.
+ *
+ * @return size of struct array
+ */
+size_t array_footprint(void)
+{
+    return sizeof(struct array);
+}
+
+/**
+ * This function makes an empty array in memory owned by the caller, which
+ * must hold array_footprint() bytes with the alignment of a pointer. The
+ * first values are stored in that memory, a buffer on the heap is only
+ * allocated when the array grows past them. Free it with array_release.
+ *
+ * @param memory the memory for the struct array
+ * @return pointer to the struct array in memory
+ */
+struct array *array_init_at(void *memory)
+{
+    struct array *a = memory;
+    a->array = a->local;
+    a->elements = 0;
+    a->array_size = ARRAY_LOCAL;
+    return a;
+}
+
 /**
  * This function creates a pointer that points to the struct array that is
  * allocated on the heap.
@@ -40,8 +76,13 @@ struct array *array_init(unsigned long initial_capacity)
     {
         return NULL;
     }
+    //! small arrays start in the room inside the struct
+    if (initial_capacity <= ARRAY_LOCAL)
+    {
+        return array_init_at(new_array);
+    }
     new_array->array_size = initial_capacity;
-    new_array->array = malloc(initial_capacity * sizeof(size_t));
+    new_array->array = malloc(initial_capacity * sizeof(int));
     //! return NULL if malloc failed and free struct array
     if (new_array->array == NULL)
     {
@@ -52,6 +93,20 @@ struct array *array_init(unsigned long initial_capacity)
     return new_array;
 }
 
+/**
+ * This function frees the buffer of an array made with array_init_at, but
+ * not the memory of the struct itself.
+ *
+ * @param a input array
+ */
+void array_release(struct array *a)
+{
+    if (a->array != a->local)
+    {
+        free(a->array);
+    }
+}
+
 /**
  * This function frees the struct array and the 1D array in the struct.
  *
@@ -59,7 +114,7 @@ struct array *array_init(unsigned long initial_capacity)
  */
 void array_cleanup(struct array *a)
 {
-    free(a->array);
+    array_release(a);
     free(a);
 }
 
@@ -81,6 +136,49 @@ int array_get(struct array *a, unsigned long index)
     return a->array[index];
 }
 
+/**
+ * This function makes room for at least the given number of elements. The
+ * size of the array is doubled until they fit.
+ *
+ * @param a input array
+ * @param size number of elements the array must be able to hold
+ * @return 0 if successfull, 1 otherwise, the array is then unchanged
+ */
+static int array_reserve(struct array *a, size_t size)
+{
+    size_t array_size = a->array_size;
+    if (size <= array_size)
+    {
+        return 0;
+    }
+    while (array_size < size)
+    {
+        array_size *= 2;
+    }
+    int *array;
+    //! the local values move to the first buffer on the heap
+    if (a->array == a->local)
+    {
+        array = malloc(array_size * sizeof(int));
+        if (array != NULL)
+        {
+            memcpy(array, a->local, a->elements * sizeof(int));
+        }
+    }
+    else
+    {
+        array = realloc(a->array, array_size * sizeof(int));
+    }
+    //! if malloc or realloc failed, the array is unchanged
+    if (array == NULL)
+    {
+        return 1;
+    }
+    a->array = array;
+    a->array_size = array_size;
+    return 0;
+}
+
 /**
  * This function adds the element at the end of the array.
  *
@@ -96,21 +194,39 @@ int array_append(struct array *a, int elem)
         return 1;
     }
     //! resize the array if number of elements is equal to size of array
-    if (a->elements == a->array_size)
+    if (array_reserve(a, a->elements + 1) != 0)
     {
-        //! if realloc failed
-        a->array = realloc(a->array, 2 * a->array_size * sizeof(size_t));
-        if (a->array == NULL)
-        {
-            return 1;
-        }
-        a->array_size = a->array_size * 2;
+        return 1;
     }
     a->array[a->elements] = elem;
     a->elements++;
     return 0;
 }
 
+/**
+ * This function adds all elements of the second array at the end of the
+ * first one, with at most one resize.
+ *
+ * @param a input array
+ * @param src the array whose elements are added, it is not changed
+ * @return 0 if successfull, 1 otherwise
+ */
+int array_extend(struct array *a, struct array *src)
+{
+    //! if an input array is NULL
+    if (a == NULL || src == NULL)
+    {
+        return 1;
+    }
+    if (array_reserve(a, a->elements + src->elements) != 0)
+    {
+        return 1;
+    }
+    memcpy(a->array + a->elements, src->array, src->elements * sizeof(int));
+    a->elements += src->elements;
+    return 0;
+}
+
 /**
  * This function returns the number of elements in the array.
  *
@@ -0,0 +1,25 @@
+/**
+ * array.h:
+ * The growable array of integers of array.c, which holds the values of a
+ * key in hash_table.c.
+ *
+*/
+
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <stddef.h>
+
+struct array;
+
+struct array *array_init(unsigned long initial_capacity);
+size_t array_footprint(void);
+struct array *array_init_at(void *memory);
+void array_release(struct array *a);
+void array_cleanup(struct array *a);
+int array_get(struct array *a, unsigned long index);
+int array_append(struct array *a, int elem);
+int array_extend(struct array *a, struct array *src);
+unsigned long array_size(struct array *a);
+
+#endif
@@ -0,0 +1,573 @@
+/**
+ * hash_bench.c:
+ * Benchmarks of hash_table.c and hash_func.c. Run it as "hash_bench name
+ * [n]", where name selects one of the benchmarks in the table at the end
+ * and n overrides its number of keys. Without arguments it lists the
+ * benchmarks.
+ *
+*/
+
+/* clock_gettime is POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "array.h"
+#include "hash_func.h"
+#include "hash_table.h"
+
+/* Number of bytes hashed per key length of the throughput benchmark. */
+#define BENCH_BYTES 200000000
+
+/* Number of keys of each length the throughput benchmark cycles through. */
+#define BENCH_STRINGS 4096
+
+/* Number of random lookups of the lookup benchmarks. */
+#define BENCH_LOOKUPS 4000000
+
+/* Most threads of the concurrent benchmark, and how long each run of it
+ * lasts in seconds. */
+#define BENCH_THREADS 8
+#define BENCH_SECONDS 0.5
+
+/* Helper function: Return the time of a monotonic clock in seconds. */
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/* Helper function: Return the next number of a xorshift generator. */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* The hash functions the hash benchmark compares. */
+static const char *hash_names[] = {"hash_function", "hash_wyhash",
+                                   "hash_crc32c"};
+static unsigned long (*const hash_funcs[])(unsigned char *) = {
+    hash_function, hash_wyhash, hash_crc32c};
+
+/**
+ * This function makes the n keys of a key set, each in a row of 96 bytes.
+ *
+ * @param n number of keys
+ * @param set 0 for random words, 1 for paths with a long shared prefix, 2
+ * for dotted IPv4 addresses
+ * @param state state of the random generator
+ * @return the keys, NULL on failure
+ */
+static char (*make_set(size_t n, int set, uint64_t *state))[96]
+{
+    char (*keys)[96] = malloc((n > 0 ? n : 1) * sizeof(*keys));
+    if (keys == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (set == 0)
+        {
+            size_t length = 3 + next_random(state) % 8;
+            for (size_t j = 0; j < length; j++)
+            {
+                keys[i][j] = (char)('a' + next_random(state) % 26);
+            }
+            sprintf(keys[i] + length, "%zu", i % 7);
+        }
+        else if (set == 1)
+        {
+            sprintf(keys[i], "/usr/share/doc/project/archive/section-%07zu.txt",
+                    i);
+        }
+        else
+        {
+            sprintf(keys[i], "10.%zu.%zu.%zu", (i >> 16) & 255, (i >> 8) & 255,
+                    i & 255);
+        }
+    }
+    return keys;
+}
+
+/**
+ * This function measures the throughput of hash_function, hash_wyhash and
+ * hash_crc32c on strings of 8 up to 4096 bytes. It then puts n keys of
+ * three key sets into the buckets of a chained table of 2^16 and of 100003
+ * buckets, with the hash value modulo the capacity as the table does, and
+ * prints the chi-square per degree of freedom of the bucket counts, 1 for
+ * an ideal hash, and the longest chain.
+ *
+ * @param n number of keys of a key set
+ */
+static void bench_hash(size_t n)
+{
+    const size_t lengths[] = {8, 16, 32, 64, 256, 4096};
+    uint64_t state = 88172645463325252ULL;
+    printf("GB/s          ");
+    for (int l = 0; l < 6; l++)
+    {
+        printf(" %6zu", lengths[l]);
+    }
+    printf("\n");
+    for (int f = 0; f < 3; f++)
+    {
+        printf("%-14s", hash_names[f]);
+        for (int l = 0; l < 6; l++)
+        {
+            size_t length = lengths[l];
+            unsigned char *text = malloc(BENCH_STRINGS * (length + 1));
+            if (text == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            for (size_t i = 0; i < BENCH_STRINGS * (length + 1); i++)
+            {
+                text[i] = (unsigned char)(i % (length + 1) == length
+                                              ? 0
+                                              : 1 + next_random(&state) % 255);
+            }
+            size_t calls = BENCH_BYTES / length;
+            unsigned long sum = 0;
+            double start = now();
+            for (size_t i = 0; i < calls; i++)
+            {
+                sum += hash_funcs[f](text + i % BENCH_STRINGS * (length + 1));
+            }
+            double end = now();
+            printf(" %6.2f", (double)(calls * length) / (end - start) * 1e-9);
+            //! keeps the calls from being optimized away
+            if (sum == 42)
+            {
+                printf("!");
+            }
+            free(text);
+        }
+        printf("\n");
+    }
+    const char *sets[] = {"words", "paths", "ips"};
+    const unsigned long capacities[] = {1UL << 16, 100003};
+    for (int set = 0; set < 3; set++)
+    {
+        char (*keys)[96] = make_set(n, set, &state);
+        unsigned *counts = calloc(100003, sizeof(unsigned));
+        if (keys == NULL || counts == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (int c = 0; c < 2; c++)
+        {
+            unsigned long capacity = capacities[c];
+            printf("%-6s %zu keys  %6lu buckets", sets[set], n, capacity);
+            for (int f = 0; f < 3; f++)
+            {
+                memset(counts, 0, capacity * sizeof(unsigned));
+                for (size_t i = 0; i < n; i++)
+                {
+                    counts[hash_funcs[f]((unsigned char *)keys[i]) %
+                           capacity]++;
+                }
+                double expected = (double)n / (double)capacity;
+                double chi = 0;
+                unsigned longest = 0;
+                for (unsigned long b = 0; b < capacity; b++)
+                {
+                    double d = counts[b] - expected;
+                    chi += d * d / expected;
+                    longest = counts[b] > longest ? counts[b] : longest;
+                }
+                printf("  %s %.2f (%u)", hash_names[f] + 5,
+                       chi / (double)(capacity - 1), longest);
+            }
+            printf("\n");
+        }
+        free(keys);
+        free(counts);
+    }
+}
+
+/**
+ * This function makes the n keys "<prefix><i>" in random order, each in a
+ * row of 32 bytes. Keys in order would have hash_function values in order,
+ * which a chained table visits in order too.
+ *
+ * @param n number of keys
+ * @param prefix text before the number
+ * @param state state of the random generator
+ * @return the keys, NULL on failure
+ */
+static char (*make_keys(size_t n, const char *prefix, uint64_t *state))[32]
+{
+    char (*keys)[32] = malloc((n > 0 ? n : 1) * sizeof(*keys));
+    if (keys == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        sprintf(keys[i], "%s%zu", prefix, i);
+    }
+    for (size_t i = n; i > 1; i--)
+    {
+        size_t j = next_random(state) % i;
+        char tmp[32];
+        memcpy(tmp, keys[i - 1], sizeof(tmp));
+        memcpy(keys[i - 1], keys[j], sizeof(tmp));
+        memcpy(keys[j], tmp, sizeof(tmp));
+    }
+    return keys;
+}
+
+/**
+ * This function fills a chained and a swiss table of n buckets or slots to
+ * load factors 0.25 up to 0.875, without a resize, and times the inserts
+ * and as many lookups of random present keys and of random missing keys,
+ * with hash_function.
+ *
+ * @param n number of buckets or slots, a power of two
+ */
+static void bench_swiss(size_t n)
+{
+    const double loads[] = {0.25, 0.5, 0.75, 0.875};
+    uint64_t state = 88172645463325252ULL;
+    char (*keys)[32] = make_keys(n, "word1a2b3c-", &state);
+    char (*missing)[32] = make_keys(n, "miss1a2b3c-", &state);
+    if (keys == NULL || missing == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    printf("ns per op     chained ins / hit / miss"
+           "    swiss ins / hit / miss\n");
+    for (int l = 0; l < 4; l++)
+    {
+        size_t count = (size_t)(loads[l] * (double)n) - 1;
+        printf("load %.3f", loads[l]);
+        for (int kind = TABLE_CHAINED; kind <= TABLE_SWISS; kind++)
+        {
+            struct table *t = table_init_kind(n, kind ? 0.875 : 1.0,
+                                              hash_function, kind);
+            if (t == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            size_t found = 0;
+            double start = now();
+            for (size_t i = 0; i < count; i++)
+            {
+                table_insert(t, keys[i], (int)i);
+            }
+            double middle = now();
+            for (size_t i = 0; i < count; i++)
+            {
+                char *key = keys[next_random(&state) % count];
+                found += table_lookup(t, key) != NULL;
+            }
+            double hits = now();
+            for (size_t i = 0; i < count; i++)
+            {
+                char *key = missing[next_random(&state) % count];
+                found += table_lookup(t, key) != NULL;
+            }
+            double end = now();
+            printf("      %6.0f / %4.0f / %4.0f%s",
+                   (middle - start) * 1e9 / (double)count,
+                   (hits - middle) * 1e9 / (double)count,
+                   (end - hits) * 1e9 / (double)count,
+                   found == count ? "" : " WRONG");
+            table_cleanup(t);
+        }
+        printf("\n");
+    }
+    free(keys);
+    free(missing);
+}
+
+/* Helper function: Compare two doubles for qsort. */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * This function inserts n random keys into a chained table that starts with
+ * 1024 buckets and times every insert on its own, so the inserts that do
+ * the work of a rehash show up. It prints the median, the 99th and 99.9th
+ * percentile and the longest insert, and the total time.
+ *
+ * @param n number of keys
+ */
+static void bench_rehash(size_t n)
+{
+    uint64_t state = 88172645463325252ULL;
+    char (*keys)[32] = make_keys(n, "key-", &state);
+    double *times = malloc((n > 0 ? n : 1) * sizeof(double));
+    struct table *t = table_init(1024, 1.0, hash_function);
+    if (keys == NULL || times == NULL || t == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    double start = now();
+    for (size_t i = 0; i < n; i++)
+    {
+        double before = now();
+        table_insert(t, keys[i], (int)i);
+        times[i] = now() - before;
+    }
+    double total = now() - start;
+    qsort(times, n, sizeof(double), compare_double);
+    printf("%zu inserts  p50 %.2f us  p99 %.2f us  p999 %.2f us  max %.2f ms"
+           "  total %.2f s\n",
+           n, times[n / 2] * 1e6, times[n / 100 * 99] * 1e6,
+           times[n / 1000 * 999] * 1e6, times[n - 1] * 1e3, total);
+    table_cleanup(t);
+    free(keys);
+    free(times);
+}
+
+/**
+ * This function fills chained tables with and without TABLE_POW2 with the
+ * keys "k<i>" to load factor 1, with hash_function and hash_wyhash, and
+ * times BENCH_LOOKUPS lookups of random present and of random missing keys.
+ *
+ * @param n number of keys and buckets
+ */
+static void bench_pow2(size_t n)
+{
+    const char *kinds[] = {"modulo", "pow2"};
+    uint64_t state = 88172645463325252ULL;
+    char (*keys)[32] = make_keys(n, "k", &state);
+    char (*missing)[32] = make_keys(n, "m", &state);
+    if (keys == NULL || missing == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    for (int f = 0; f < 2; f++)
+    {
+        for (int pow2 = 0; pow2 <= 1; pow2++)
+        {
+            struct table *t = table_init_kind(n, 1.0, hash_funcs[f],
+                                              pow2 ? TABLE_POW2 : 0);
+            if (t == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                table_insert(t, keys[i], (int)i);
+            }
+            size_t found = 0;
+            double start = now();
+            for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+            {
+                char *key = keys[next_random(&state) % n];
+                found += table_lookup(t, key) != NULL;
+            }
+            double middle = now();
+            for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+            {
+                char *key = missing[next_random(&state) % n];
+                found += table_lookup(t, key) != NULL;
+            }
+            double end = now();
+            printf("%zu keys  %-13s %-6s  hit %4.0f ns  miss %4.0f ns%s\n", n,
+                   hash_names[f], kinds[pow2],
+                   (middle - start) * 1e9 / BENCH_LOOKUPS,
+                   (end - middle) * 1e9 / BENCH_LOOKUPS,
+                   found == BENCH_LOOKUPS ? "" : "  WRONG");
+            table_cleanup(t);
+        }
+    }
+    free(keys);
+    free(missing);
+}
+
+/**
+ * Thread of the concurrent benchmark
+ * @param t the shared table
+ * @param lock the lock around every call, NULL for a concurrent table
+ * @param keys the keys in the table
+ * @param n number of keys
+ * @param reads percentage of the operations that are lookups
+ * @param seed seed of the random generator
+ * @param end time the thread stops at
+ * @param ops operations done
+ */
+struct bench_thread
+{
+    struct table *t;
+    pthread_mutex_t *lock;
+    char (*keys)[32];
+    size_t n;
+    int reads;
+    uint64_t seed;
+    double end;
+    size_t ops;
+};
+
+/* Helper function: Look up random keys, or delete one and insert it again,
+ * until the end time. */
+static void *bench_worker(void *arg)
+{
+    struct bench_thread *b = arg;
+    do
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            char *key = b->keys[next_random(&b->seed) % b->n];
+            int read = (int)(next_random(&b->seed) % 100) < b->reads;
+            if (b->lock != NULL)
+            {
+                pthread_mutex_lock(b->lock);
+            }
+            if (read)
+            {
+                table_lookup(b->t, key);
+            }
+            else
+            {
+                table_delete(b->t, key);
+                table_insert(b->t, key, 0);
+            }
+            if (b->lock != NULL)
+            {
+                pthread_mutex_unlock(b->lock);
+            }
+        }
+        b->ops += 256;
+    } while (now() < b->end);
+    return NULL;
+}
+
+/**
+ * This function shares a swiss table of n keys between 1 up to
+ * BENCH_THREADS threads, which do 50%, 90% or 99% lookups and otherwise
+ * replace a key, for BENCH_SECONDS each. It compares one mutex around a
+ * plain table with a table made with TABLE_CONCURRENT, and prints the
+ * operations per second of all threads together.
+ *
+ * @param n number of keys
+ */
+static void bench_concurrent(size_t n)
+{
+    const int reads[] = {50, 90, 99};
+    uint64_t state = 88172645463325252ULL;
+    char (*keys)[32] = make_keys(n, "key-", &state);
+    if (keys == NULL || n == 0)
+    {
+        fprintf(stderr, "out of memory or no keys\n");
+        exit(1);
+    }
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    for (int r = 0; r < 3; r++)
+    {
+        for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+        {
+            printf("%d%% reads  %d threads", reads[r], threads);
+            for (int concurrent = 0; concurrent <= 1; concurrent++)
+            {
+                int kind = TABLE_SWISS | (concurrent ? TABLE_CONCURRENT : 0);
+                struct table *t =
+                    table_init_kind(n, 0.875, hash_function, kind);
+                if (t == NULL)
+                {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+                for (size_t i = 0; i < n; i++)
+                {
+                    table_insert(t, keys[i], 0);
+                }
+                struct bench_thread workers[BENCH_THREADS];
+                pthread_t ids[BENCH_THREADS];
+                double end = now() + BENCH_SECONDS;
+                for (int i = 0; i < threads; i++)
+                {
+                    workers[i] = (struct bench_thread){
+                        t, concurrent ? NULL : &lock, keys, n, reads[r],
+                        state + (uint64_t)i, end, 0};
+                    pthread_create(&ids[i], NULL, bench_worker, &workers[i]);
+                }
+                size_t ops = 0;
+                for (int i = 0; i < threads; i++)
+                {
+                    pthread_join(ids[i], NULL);
+                    ops += workers[i].ops;
+                }
+                printf("  %s %5.2f Mops/s", concurrent ? "sharded" : "mutex",
+                       (double)ops / BENCH_SECONDS * 1e-6);
+                table_cleanup(t);
+            }
+            printf("\n");
+        }
+    }
+    free(keys);
+}
+
+/**
+ * Benchmark
+ * @param name the name it is run with
+ * @param about what it measures
+ * @param keys default number of keys
+ * @param run the benchmark
+ */
+struct benchmark
+{
+    const char *name;
+    const char *about;
+    size_t keys;
+    void (*run)(size_t n);
+};
+
+static const struct benchmark benchmarks[] = {
+    {"hash", "throughput and chain lengths of the string hash functions",
+     1 << 18, bench_hash},
+    {"swiss", "chained against swiss tables at fixed load factors", 1 << 20,
+     bench_swiss},
+    {"rehash", "latency of single inserts into a growing chained table",
+     4000000, bench_rehash},
+    {"pow2", "lookups in chained tables with and without TABLE_POW2", 1 << 20,
+     bench_pow2},
+    {"concurrent", "a shared swiss table, one mutex against TABLE_CONCURRENT",
+     1 << 16, bench_concurrent},
+};
+
+int main(int argc, char **argv)
+{
+    size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (size_t i = 0; argc > 1 && i < count; i++)
+    {
+        if (strcmp(argv[1], benchmarks[i].name) == 0)
+        {
+            size_t n = benchmarks[i].keys;
+            if (argc > 2)
+            {
+                n = (size_t)strtoul(argv[2], NULL, 10);
+            }
+            benchmarks[i].run(n);
+            return 0;
+        }
+    }
+    fprintf(stderr, "usage: %s name [n]\n", argv[0]);
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(stderr, "  %-10s %s, %zu keys\n", benchmarks[i].name,
+                benchmarks[i].about, benchmarks[i].keys);
+    }
+    return argc > 1;
+}
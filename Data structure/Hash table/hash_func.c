@@ -9,6 +9,22 @@
  *
 */
 
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#include "hash_func.h"
+
+/* Constants of the wyhash mixing steps. */
+#define WY_P0 0x2d358dccaa6c78a5ULL
+#define WY_P1 0x8bb84b93962eacc9ULL
+#define WY_P2 0x4b33a62ed433d4a3ULL
+#define WY_P3 0x4d5a2da51de1aa47ULL
+
+/* Seed of hash_wyhash and hash_crc32c, changed with hash_set_seed. */
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
 /* Do not edit this function, as it used in testing too
  * Add you own hash functions with different headers instead. */
 unsigned long hash_too_simple(unsigned char *str)
@@ -30,3 +46,231 @@ unsigned long hash_function(unsigned char *key)
     }
     return h;
 }
+
+/**
+ * This function sets the seed of hash_wyhash and hash_crc32c. With a random
+ * seed, inputs made to collide in hash_wyhash do not collide anymore, which
+ * keeps them from producing long chains. hash_crc32c gives no such
+ * protection: a CRC is linear, so inputs with equal CRCs are easy to make
+ * and stay equal under every seed. A table keeps the hash values of its
+ * keys, so the seed must not change while a table that uses these functions
+ * holds keys.
+ *
+ * @param new_seed the new seed
+ */
+void hash_set_seed(uint64_t new_seed)
+{
+    seed = new_seed;
+}
+
+/* Helper function: Multiply *a and *b, and store the low half of the 128-bit
+ * product in *a and the high half in *b. */
+static void wy_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ unsigned __int128 r = (unsigned __int128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, la = (uint32_t)*a, hb = *b >> 32, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+/* Helper function: Return the low half of the 128-bit product of a and b
+ * xor the high half. */
+static uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+/* Helper function: Read 8 bytes, in any alignment. */
+static uint64_t read8(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+/* Helper function: Read 4 bytes, in any alignment. */
+static uint64_t read4(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/**
+ * This function calculates a 64-bit hash value of len bytes, following the
+ * design of wyhash. Keys of up to 16 bytes are read with a few overlapping
+ * loads, longer keys 48 bytes at a time in three independent lanes, so the
+ * loop is limited by the multiplier and not by the latency of one chain.
+ *
+ * @param key the input bytes, need not be NUL-terminated
+ * @param len number of bytes
+ * @param hash_seed the seed
+ * @return hash value
+ */
+uint64_t hash_wyhash_n(const void *key, size_t len, uint64_t hash_seed)
+{
+    const unsigned char *p = key;
+    uint64_t a, b;
+    hash_seed ^= wy_mix(hash_seed ^ WY_P0, WY_P1);
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            //! the first and last 4 bytes, and 4 more from each half
+            size_t mid = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + mid);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - mid);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+                p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            uint64_t see1 = hash_seed, see2 = hash_seed;
+            do
+            {
+                hash_seed = wy_mix(read8(p) ^ WY_P1, read8(p + 8) ^ hash_seed);
+                see1 = wy_mix(read8(p + 16) ^ WY_P2, read8(p + 24) ^ see1);
+                see2 = wy_mix(read8(p + 32) ^ WY_P3, read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            hash_seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            hash_seed = wy_mix(read8(p) ^ WY_P1, read8(p + 8) ^ hash_seed);
+            i -= 16;
+            p += 16;
+        }
+        //! the last 16 bytes, which may overlap bytes already read
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    a ^= WY_P1;
+    b ^= hash_seed;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ WY_P0 ^ len, b ^ WY_P1);
+}
+
+/**
+ * This function calculates the hash value of a input string with
+ * hash_wyhash_n and the seed set with hash_set_seed.
+ *
+ * @param key input string
+ * @return hash value
+ */
+unsigned long hash_wyhash(unsigned char *key)
+{
+    return (unsigned long)hash_wyhash_n(key, strlen((char *)key), seed);
+}
+
+/**
+ * This function calculates the hash value of length bytes with
+ * hash_wyhash_n and the seed set with hash_set_seed. For a string it is
+ * equal to hash_wyhash, for use with table_init_n.
+ *
+ * @param key the input bytes, need not be NUL-terminated
+ * @param length number of bytes
+ * @return hash value
+ */
+unsigned long hash_wyhash_len(const void *key, size_t length)
+{
+    return (unsigned long)hash_wyhash_n(key, length, seed);
+}
+
+/**
+ * This function calculates a 64-bit hash value of len bytes with the CRC32C
+ * instruction of SSE4.2. Two CRCs run side by side over 16 bytes per step,
+ * and a multiply at the end spreads their 64 bits over the whole result,
+ * which a CRC on its own does not do. The seed starts both CRCs and is mixed
+ * into the multiply, but inputs whose CRCs are equal collide under every
+ * seed, use hash_wyhash_n against inputs made to collide. Without SSE4.2 it
+ * returns hash_wyhash_n, which is faster than a CRC computed in software.
+ *
+ * @param key the input bytes, need not be NUL-terminated
+ * @param len number of bytes
+ * @param hash_seed the seed
+ * @return hash value
+ */
+uint64_t hash_crc32c_n(const void *key, size_t len, uint64_t hash_seed)
+{
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    const unsigned char *p = key;
+    uint64_t lo = (uint32_t)hash_seed;
+    uint64_t hi = hash_seed >> 32;
+    size_t i = len;
+    while (i >= 16)
+    {
+        lo = _mm_crc32_u64(lo, read8(p));
+        hi = _mm_crc32_u64(hi, read8(p + 8));
+        p += 16;
+        i -= 16;
+    }
+    if (i >= 8)
+    {
+        lo = _mm_crc32_u64(lo, read8(p));
+        p += 8;
+        i -= 8;
+    }
+    if (i > 0)
+    {
+        //! the last bytes, padded with zeroes
+        uint64_t tail = 0;
+        memcpy(&tail, p, i);
+        hi = _mm_crc32_u64(hi, tail);
+    }
+    //! the seed goes through the multiply too, a CRC alone is linear in it
+    return wy_mix((lo << 32 | hi) ^ WY_P0, len ^ hash_seed ^ WY_P1);
+#else
+    return hash_wyhash_n(key, len, hash_seed);
+#endif
+}
+
+/**
+ * This function calculates the hash value of a input string with
+ * hash_crc32c_n and the seed set with hash_set_seed.
+ *
+ * @param key input string
+ * @return hash value
+ */
+unsigned long hash_crc32c(unsigned char *key)
+{
+    return (unsigned long)hash_crc32c_n(key, strlen((char *)key), seed);
+}
+
+/**
+ * This function calculates the hash value of length bytes with
+ * hash_crc32c_n and the seed set with hash_set_seed. For a string it is
+ * equal to hash_crc32c, for use with table_init_n.
+ *
+ * @param key the input bytes, need not be NUL-terminated
+ * @param length number of bytes
+ * @return hash value
+ */
+unsigned long hash_crc32c_len(const void *key, size_t length)
+{
+    return (unsigned long)hash_crc32c_n(key, length, seed);
+}
@@ -0,0 +1,24 @@
+/**
+ * hash_func.h:
+ * The hash functions of hash_func.c. The functions that take a string fit
+ * table_init and table_init_kind, the _len functions fit table_init_n.
+ *
+*/
+
+#ifndef HASH_FUNC_H
+#define HASH_FUNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+unsigned long hash_too_simple(unsigned char *str);
+unsigned long hash_function(unsigned char *key);
+void hash_set_seed(uint64_t new_seed);
+uint64_t hash_wyhash_n(const void *key, size_t len, uint64_t hash_seed);
+unsigned long hash_wyhash(unsigned char *key);
+unsigned long hash_wyhash_len(const void *key, size_t length);
+uint64_t hash_crc32c_n(const void *key, size_t len, uint64_t hash_seed);
+unsigned long hash_crc32c(unsigned char *key);
+unsigned long hash_crc32c_len(const void *key, size_t length);
+
+#endif
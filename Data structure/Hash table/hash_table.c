@@ -1,91 +1,765 @@
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "array.h"
 #include "hash_func.h"
+#include "hash_table.h"
+
+/* Keys shorter than this are copied on the stack when they have to be
+ * followed by a NUL for the hash function. */
+#define KEY_BUFFER 256
+
+/* A concurrent table divides its keys over 2^TABLE_SHARD_BITS tables, each
+ * with its own lock, by the high bits of the mixed hash value. */
+#define TABLE_SHARD_BITS 6
+#define TABLE_SHARDS (1 << TABLE_SHARD_BITS)
+
+/* Slots per group of a swiss table. The control bytes of a group are
+ * compared with one SSE2 instruction. */
+#define SWISS_GROUP 16
+
+/* Control bytes of a swiss table. A full slot stores the low 7 bits of the
+ * hash, which leaves the high bit for the two special values. */
+#define SWISS_EMPTY 0x80
+#define SWISS_DELETED 0xFE
+
+/* Number of indices of the old array that an insert or delete moves while
+ * a chained table is being rehashed. With a maximum load factor of at least
+ * 1 / REHASH_STEP the rehash is done before the table grows again. */
+#define REHASH_STEP 8
+
+/* Highest load factor of a swiss table, higher factors are lowered to it.
+ * Probing stops at the first group with an empty slot, so some must stay. */
+#define SWISS_MAX_LOAD 0.875
 
 /**
  * Struct table
  * @param array the 2D array that contains all the nodes in the hash table
  * @param hash_func the function used for computng the hash value
+ * @param hash_func_n the function used for computing the hash value of a
+ * key with a length, NULL if the table uses hash_func
  * @param max_load_factor maximum load factor of a hash table
  * @param capacity capacity of the array used to index the table
  * @param load current number of elements stored in the table
+ * @param kind the kind of table: TABLE_CHAINED or TABLE_SWISS
+ * @param pow2 1 if the table was made with TABLE_POW2
+ * @param borrow 1 if the table was made with TABLE_BORROW
+ * @param ctrl one control byte per slot of a swiss table
+ * @param slots the slots of a swiss table, array is not used by it
+ * @param growth_left number of empty slots a swiss table may still fill
+ * before it is rehashed
+ * @param old_array the array a chained table is being rehashed from, NULL
+ * if no rehash is in progress
+ * @param old_capacity capacity of old_array
+ * @param rehash_index indices of old_array below this one have been moved
+ * @param shards the tables a concurrent table divides its keys over, NULL
+ * if the table is not concurrent
+ * @param lock serializes the operations on a shard of a concurrent table
  */
 struct table
 {
     struct node **array;
     unsigned long (*hash_func)(unsigned char *);
+    unsigned long (*hash_func_n)(const void *, size_t);
     double max_load_factor;
     unsigned long capacity;
     unsigned long load;
+    int kind;
+    int pow2;
+    int borrow;
+    unsigned char *ctrl;
+    struct slot *slots;
+    unsigned long growth_left;
+    struct node **old_array;
+    unsigned long old_capacity;
+    unsigned long rehash_index;
+    struct table **shards;
+    pthread_mutex_t lock;
 };
 
 /**
  * Struct node
+ * A node is one block on the heap: the struct, then its value array, then
+ * the characters of its key.
  * @param key the string of characters that is the key for this node
  * @param value a resizing array, containing all the integer values for the key
  * @param next next pointer
+ * @param hash hash value of the key
+ * @param length length of the key
  */
 struct node
 {
     char *key;
     struct array *value;
     struct node *next;
+    unsigned long hash;
+    size_t length;
 };
 
 /**
- * This function creates new hash table and returns a pointer to it.
+ * Struct slot
+ * @param node the node that holds the key and values of this slot, its next
+ * pointer is not used
+ * @param hash mixed hash value of the key
+ * @param length length of the key
+ */
+struct slot
+{
+    struct node *node;
+    uint64_t hash;
+    size_t length;
+};
+
+/**
+ * This function makes a node for a new key with one malloc. The value array
+ * and the copy of the key are stored in the same block as the node, and the
+ * array keeps its first values inside itself, so a key gets no further
+ * allocations until it has more values than that. A borrowed key is not
+ * copied, the node points to it.
  *
- * @return a pointer to the struct table that is allocated on the heap
+ * @param key input key
+ * @param length length of the key
+ * @param hash_value hash value of the key
+ * @param value the first value of the key
+ * @param borrow 1 if the key is borrowed
+ * @return a pointer to the new node, NULL on failure
+ */
+static struct node *make_node(const char *key, size_t length,
+                              unsigned long hash_value, int value,
+                              int borrow)
+{
+    size_t footprint = array_footprint();
+    struct node *new_node = malloc(sizeof(struct node) + footprint +
+                                   (borrow ? 0 : length + 1));
+    //! return NULL if malloc failed
+    if (new_node == NULL)
+    {
+        return NULL;
+    }
+    new_node->value = array_init_at(new_node + 1);
+    if (borrow)
+    {
+        new_node->key = (char *)key;
+    }
+    else
+    {
+        //! the copy ends with a NUL, even if the key does not
+        new_node->key = (char *)new_node->value + footprint;
+        memcpy(new_node->key, key, length);
+        new_node->key[length] = '\0';
+    }
+    new_node->hash = hash_value;
+    new_node->length = length;
+    new_node->next = NULL;
+    array_append(new_node->value, value);
+    return new_node;
+}
+
+/* Helper function: Free a node together with its key and values. */
+static void free_node(struct node *n)
+{
+    array_release(n->value);
+    free(n);
+}
+
+/**
+ * This function checks if a node holds the given key. The hash values and
+ * lengths are compared first, so the bytes of the key are only read when it
+ * is almost certainly a match.
+ *
+ * @param n input node
+ * @param key the input key
+ * @param hash_value hash value of the key
+ * @param length length of the key
+ * @return 1 if the node holds the key, 0 otherwise
+ */
+static int node_match(const struct node *n, const char *key,
+                      unsigned long hash_value, size_t length)
+{
+    return n->hash == hash_value && n->length == length &&
+           memcmp(n->key, key, length) == 0;
+}
+
+/**
+ * This function mixes the bits of a hash value, so that every bit of the
+ * result depends on all of its bits. Tables that take an index from the low
+ * bits, or a group and a control byte from separate bits, use it to stay
+ * safe with weak hash functions.
+ *
+ * @param hash_value input hash value
+ * @return mixed hash value
+ */
+static uint64_t hash_mix(uint64_t hash_value)
+{
+    hash_value ^= hash_value >> 33;
+    hash_value *= 0xff51afd7ed558ccdULL;
+    hash_value ^= hash_value >> 33;
+    return hash_value;
+}
+
+/* Helper function: Return the hash value a table keeps for a key with the
+ * given hash value, mixed if the table takes its index from the low bits. */
+static unsigned long table_hash(struct table *t, unsigned long hash_value)
+{
+    if (t->kind == TABLE_SWISS || t->pow2)
+    {
+        return (unsigned long)hash_mix(hash_value);
+    }
+    return hash_value;
+}
+
+/* Helper function: Return the index of a hash value in an array of the
+ * given capacity of a chained table. A TABLE_POW2 table masks the low bits
+ * instead of dividing. */
+static unsigned long table_index(struct table *t, unsigned long hash_value,
+                                 unsigned long capacity)
+{
+    return t->pow2 ? hash_value & (capacity - 1) : hash_value % capacity;
+}
+
+/**
+ * This function moves the nodes of at most the given number of indices of
+ * the old array of a table that is being rehashed to the new array. The old
+ * array is freed once it is empty. The nodes are relinked, not copied, and
+ * their stored hash values are used, so no key is hashed again.
+ *
+ * @param t the input hash table
+ * @param buckets maximum number of indices to move
+ */
+static void rehash_step(struct table *t, unsigned long buckets)
+{
+    while (buckets > 0 && t->rehash_index < t->old_capacity)
+    {
+        struct node *tmp = t->old_array[t->rehash_index];
+        while (tmp != NULL)
+        {
+            struct node *next = tmp->next;
+            unsigned long hash_index =
+                table_index(t, tmp->hash, t->capacity);
+            //! push the node on the front of its new list
+            tmp->next = t->array[hash_index];
+            t->array[hash_index] = tmp;
+            tmp = next;
+        }
+        t->old_array[t->rehash_index] = NULL;
+        t->rehash_index++;
+        buckets--;
+    }
+    //! the rehash is done when every index has been moved
+    if (t->old_array != NULL && t->rehash_index == t->old_capacity)
+    {
+        free(t->old_array);
+        t->old_array = NULL;
+        t->old_capacity = 0;
+        t->rehash_index = 0;
+    }
+}
+
+/**
+ * This function doubles the capacity of a table. Only the new array is made
+ * here, the nodes are moved to it a few indices at a time by the inserts and
+ * deletes that follow, so no single operation pays for the whole rehash. A
+ * rehash that is still in progress is finished first. If there is no memory
+ * for the new array the table keeps its capacity.
+ *
+ * @param t the input hash table
  */
 void resize(struct table *t)
 {
-    size_t capacity = t->capacity;
-    struct node **array = t->array;
-    t->array = realloc(t->array, capacity * 2 * sizeof(struct node *));
-    t->capacity = 2 * capacity;
-    for (size_t i = 0; i < t->capacity; i++)
+    //! the shards of a concurrent table grow on their own
+    if (t->shards != NULL)
     {
-        t->array[i] = NULL;
+        return;
     }
-    for (size_t i = 0; i < capacity; i++)
+    rehash_step(t, t->old_capacity);
+    //! calloc gets large arrays zeroed from the system, without a loop here
+    struct node **array = calloc(2 * t->capacity, sizeof(struct node *));
+    if (array == NULL)
+    {
+        return;
+    }
+    t->old_array = t->array;
+    t->old_capacity = t->capacity;
+    t->rehash_index = 0;
+    t->array = array;
+    t->capacity = 2 * t->capacity;
+}
+
+/* Helper function: Start a rehash of a chained table that is about to get a
+ * key when the load factor is reached, or move a part of the rehash that is
+ * in progress. */
+static void chained_step(struct table *t)
+{
+    if ((double)t->load / (double)t->capacity >= (double)t->max_load_factor)
+    {
+        resize(t);
+    }
+    else if (t->old_array != NULL)
     {
-        while (array[i] != NULL)
-        {
-            struct node *tmp = array[i];
-            array[i] = array[i]->next;
-            tmp->next = NULL;
-            unsigned long hash_value = t->hash_func((unsigned char *)tmp->key);
-            unsigned long hash_index = hash_value % t->capacity;
-            struct node *new_node = malloc(sizeof(struct node));
-            new_node->key = tmp->key;
-            new_node->value = tmp->value;
-            new_node->next = NULL;
-            if (t->array[hash_index] == NULL)
+        rehash_step(t, REHASH_STEP);
+    }
+}
+
+/**
+ * This function returns the list of a chained table that a key with the
+ * given hash value belongs to. While the table is being rehashed that is the
+ * list in the old array, unless its index has already been moved.
+ *
+ * @param t the input hash table
+ * @param hash_value hash value of the key
+ * @return a pointer to the head of the list
+ */
+static struct node **table_bucket(struct table *t, unsigned long hash_value)
+{
+    if (t->old_array != NULL)
+    {
+        unsigned long old_index =
+            table_index(t, hash_value, t->old_capacity);
+        if (old_index >= t->rehash_index)
+        {
+            return &t->old_array[old_index];
+        }
+    }
+    return &t->array[table_index(t, hash_value, t->capacity)];
+}
+
+/**
+ * This function compares the control bytes of a group with byte.
+ *
+ * @param ctrl the first control byte of the group
+ * @param byte the control byte to look for
+ * @return a mask with bit i set if control byte i is equal to byte
+ */
+static unsigned swiss_match(const unsigned char *ctrl, unsigned char byte)
+{
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (unsigned)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < SWISS_GROUP; i++)
+    {
+        mask |= (unsigned)(ctrl[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * This function finds the slots of a group that are empty or deleted, which
+ * are the control bytes with the high bit set.
+ *
+ * @param ctrl the first control byte of the group
+ * @return a mask with bit i set if slot i of the group is free
+ */
+static unsigned swiss_free(const unsigned char *ctrl)
+{
+#if defined(__SSE2__)
+    return (unsigned)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)ctrl));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < SWISS_GROUP; i++)
+    {
+        mask |= (unsigned)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+/* Helper function: Return the number of slots of a swiss table with the
+ * given capacity that may be filled before it is rehashed. */
+static unsigned long swiss_limit(struct table *t, unsigned long capacity)
+{
+    double load_factor = t->max_load_factor;
+    if (load_factor <= 0 || load_factor > SWISS_MAX_LOAD)
+    {
+        load_factor = SWISS_MAX_LOAD;
+    }
+    return (unsigned long)((double)capacity * load_factor);
+}
+
+/**
+ * This function gives a swiss table empty slots and control bytes for the
+ * given capacity, the old ones are not freed.
+ *
+ * @param t the input hash table
+ * @param capacity number of slots, a power of two and at least SWISS_GROUP
+ * @return 0 if successfull else return 1
+ */
+static int swiss_alloc(struct table *t, unsigned long capacity)
+{
+    unsigned char *ctrl = malloc(capacity);
+    struct slot *slots = malloc(capacity * sizeof(struct slot));
+    //! return 1 if malloc failed
+    if (ctrl == NULL || slots == NULL)
+    {
+        free(ctrl);
+        free(slots);
+        return 1;
+    }
+    memset(ctrl, SWISS_EMPTY, capacity);
+    t->ctrl = ctrl;
+    t->slots = slots;
+    t->capacity = capacity;
+    t->growth_left = swiss_limit(t, capacity) - t->load;
+    return 0;
+}
+
+/**
+ * This function searches a key in a swiss table. Groups are probed in
+ * triangular order, which visits every group once since the number of
+ * groups is a power of two. A key is never stored past a group with an
+ * empty slot, so the search stops at the first one.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @param hash_value mixed hash value of the key
+ * @param length length of the key
+ * @return index of the slot that holds the key, or the capacity of the table
+ * if the key is not present
+ */
+static unsigned long swiss_find(struct table *t, const char *key,
+                                uint64_t hash_value, size_t length)
+{
+    unsigned long group_mask = t->capacity / SWISS_GROUP - 1;
+    unsigned long group = (unsigned long)(hash_value >> 7) & group_mask;
+    unsigned char tag = (unsigned char)(hash_value & 0x7F);
+    for (unsigned long step = 1;; step++)
+    {
+        const unsigned char *ctrl = &t->ctrl[group * SWISS_GROUP];
+        //! compare only the keys whose control byte matches
+        unsigned mask = swiss_match(ctrl, tag);
+        while (mask != 0)
+        {
+            unsigned long i =
+                group * SWISS_GROUP + (unsigned long)__builtin_ctz(mask);
+            if (t->slots[i].hash == hash_value &&
+                t->slots[i].length == length &&
+                memcmp(t->slots[i].node->key, key, length) == 0)
             {
-                t->array[hash_index] = new_node;
-                free(tmp);
+                return i;
             }
-            else
+            mask &= mask - 1;
+        }
+        if (swiss_match(ctrl, SWISS_EMPTY) != 0)
+        {
+            return t->capacity;
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+/* Helper function: Return the index of the first empty or deleted slot on
+ * the probe sequence of a hash value in a swiss table. */
+static unsigned long swiss_free_slot(struct table *t, uint64_t hash_value)
+{
+    unsigned long group_mask = t->capacity / SWISS_GROUP - 1;
+    unsigned long group = (unsigned long)(hash_value >> 7) & group_mask;
+    for (unsigned long step = 1;; step++)
+    {
+        unsigned mask = swiss_free(&t->ctrl[group * SWISS_GROUP]);
+        if (mask != 0)
+        {
+            return group * SWISS_GROUP + (unsigned long)__builtin_ctz(mask);
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+/**
+ * This function moves all keys of a swiss table to new slots of the given
+ * capacity, which also clears all deleted slots. The stored hash values are
+ * used, so no key is hashed again.
+ *
+ * @param t the input hash table
+ * @param capacity the new number of slots
+ * @return 0 if successfull else return 1
+ */
+static int swiss_rehash(struct table *t, unsigned long capacity)
+{
+    unsigned char *ctrl = t->ctrl;
+    struct slot *slots = t->slots;
+    unsigned long old_capacity = t->capacity;
+    if (swiss_alloc(t, capacity) != 0)
+    {
+        return 1;
+    }
+    for (unsigned long i = 0; i < old_capacity; i++)
+    {
+        //! skip empty and deleted slots
+        if (ctrl[i] & 0x80)
+        {
+            continue;
+        }
+        unsigned long j = swiss_free_slot(t, slots[i].hash);
+        t->ctrl[j] = ctrl[i];
+        t->slots[j] = slots[i];
+    }
+    free(ctrl);
+    free(slots);
+    return 0;
+}
+
+/**
+ * This function puts a node whose key is not yet present into a free slot of
+ * a swiss table. The table grows first if it has no empty slots left.
+ *
+ * @param t the input hash table
+ * @param n the node, its hash value is the mixed hash value of its key
+ * @return 0 if successfull else return 1
+ */
+static int swiss_add(struct table *t, struct node *n)
+{
+    //! grow when the table is at least half full, otherwise only the
+    //! deleted slots are cleared
+    while (t->growth_left == 0)
+    {
+        unsigned long capacity = t->capacity;
+        if (t->load >= swiss_limit(t, capacity) / 2)
+        {
+            capacity *= 2;
+        }
+        if (swiss_rehash(t, capacity) != 0)
+        {
+            return 1;
+        }
+    }
+    unsigned long i = swiss_free_slot(t, n->hash);
+    //! a deleted slot is reused without using up an empty one
+    if (t->ctrl[i] == SWISS_EMPTY)
+    {
+        t->growth_left--;
+    }
+    t->ctrl[i] = (unsigned char)(n->hash & 0x7F);
+    t->slots[i].node = n;
+    t->slots[i].hash = n->hash;
+    t->slots[i].length = n->length;
+    t->load++;
+    return 0;
+}
+
+/**
+ * This function inserts a key and value into a swiss table, see
+ * table_insert.
+ *
+ * @param t the input hash table
+ * @param key input key
+ * @param length length of the key
+ * @param hash_value mixed hash value of the key
+ * @param value input value
+ * @return 0 if successfull else return 1
+ */
+static int swiss_insert(struct table *t, const char *key, size_t length,
+                        uint64_t hash_value, int value)
+{
+    unsigned long i = swiss_find(t, key, hash_value, length);
+    //! if the key already exist, append the value to its array
+    if (i != t->capacity)
+    {
+        return array_append(t->slots[i].node->value, value);
+    }
+    struct node *new_node =
+        make_node(key, length, hash_value, value, t->borrow);
+    if (new_node == NULL)
+    {
+        return 1;
+    }
+    if (swiss_add(t, new_node) != 0)
+    {
+        free_node(new_node);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * This function removes a key from a swiss table, see table_delete. The
+ * slot becomes empty again if its group still has an empty slot, since then
+ * no search went past the group. Otherwise it is marked deleted.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @param length length of the key
+ * @param hash_value mixed hash value of the key
+ * @return 0 if key was removed, 1 if the key was not present in the table
+ */
+static int swiss_delete(struct table *t, const char *key, size_t length,
+                        uint64_t hash_value)
+{
+    unsigned long i = swiss_find(t, key, hash_value, length);
+    if (i == t->capacity)
+    {
+        return 1;
+    }
+    free_node(t->slots[i].node);
+    if (swiss_match(&t->ctrl[i - i % SWISS_GROUP], SWISS_EMPTY) != 0)
+    {
+        t->ctrl[i] = SWISS_EMPTY;
+        t->growth_left++;
+    }
+    else
+    {
+        t->ctrl[i] = SWISS_DELETED;
+    }
+    t->load--;
+    return 0;
+}
+
+static struct table *table_make(unsigned long capacity,
+                                double max_load_factor,
+                                unsigned long (*hash_func)(unsigned char *),
+                                unsigned long (*hash_func_n)(const void *,
+                                                             size_t),
+                                int kind);
+
+/**
+ * This function makes the shards of a concurrent table, see table_init_kind.
+ * Each shard is a table of the given kind with its own lock and its own
+ * share of the capacity, so a shard that grows blocks only the keys that
+ * belong to it.
+ *
+ * @param t the concurrent table, its other fields already set
+ * @param capacity initial capacity of the whole table
+ * @param kind TABLE_CHAINED or TABLE_SWISS, optionally with TABLE_POW2 and
+ * TABLE_BORROW
+ * @return 0 if successfull else return 1
+ */
+static int shards_init(struct table *t, unsigned long capacity, int kind)
+{
+    t->shards = malloc(TABLE_SHARDS * sizeof(struct table *));
+    if (t->shards == NULL)
+    {
+        return 1;
+    }
+    for (int i = 0; i < TABLE_SHARDS; i++)
+    {
+        t->shards[i] = table_make(capacity / TABLE_SHARDS + 1,
+                                  t->max_load_factor, t->hash_func,
+                                  t->hash_func_n, kind);
+        if (t->shards[i] != NULL &&
+            pthread_mutex_init(&t->shards[i]->lock, NULL) != 0)
+        {
+            table_cleanup(t->shards[i]);
+            t->shards[i] = NULL;
+        }
+        //! free the shards made so far on failure
+        if (t->shards[i] == NULL)
+        {
+            while (i-- > 0)
             {
-                struct node *table_node = t->array[hash_index];
-                while (table_node->next != NULL)
-                {
-                    table_node = table_node->next;
-                }
-                table_node->next = new_node;
-                free(tmp);
-            };
+                pthread_mutex_destroy(&t->shards[i]->lock);
+                table_cleanup(t->shards[i]);
+            }
+            free(t->shards);
+            return 1;
         }
     }
+    t->capacity = capacity;
+    return 0;
 }
 
-struct table *table_init(unsigned long capacity,
-                         double max_load_factor,
-                         unsigned long (*hash_func)(unsigned char *))
+/**
+ * This function creates a new hash table of the given kind and returns a
+ * pointer to it. A TABLE_CHAINED table keeps a linked list of nodes per
+ * index, a TABLE_SWISS table keeps the keys in one array of slots and finds
+ * them through control bytes that are compared 16 at a time. The capacity of
+ * a swiss table is rounded up to a power of two, and its load factor never
+ * goes above 0.875. With TABLE_POW2 the capacity of a chained table is
+ * rounded up to a power of two as well.
+ *
+ * With TABLE_BORROW the table does not copy its keys, it keeps pointers to
+ * the keys it is given. They must stay unchanged for as long as they are in
+ * the table, which suits keys that are slices of a mapped file.
+ *
+ * With TABLE_CONCURRENT the table may be used by several threads at once.
+ * Its keys are divided over 64 shards of the given kind, and every call
+ * locks only the shard of its key, so threads that work on different shards
+ * do not wait for each other. Each shard grows by itself. A chained shard
+ * moves its nodes a few at a time, so inserts into a growing shard are not
+ * stalled either. An array returned by table_lookup is not locked: it must
+ * not be read while another thread inserts into or deletes the same key.
+ *
+ * @param capacity initial capacity of the table
+ * @param max_load_factor the table grows when its load factor reaches this
+ * @param hash_func the function used for computing the hash value
+ * @param kind TABLE_CHAINED or TABLE_SWISS, optionally with TABLE_POW2,
+ * TABLE_BORROW and TABLE_CONCURRENT
+ * @return a pointer to the struct table that is allocated on the heap, NULL
+ * on failure
+ */
+struct table *table_init_kind(unsigned long capacity,
+                              double max_load_factor,
+                              unsigned long (*hash_func)(unsigned char *),
+                              int kind)
+{
+    return table_make(capacity, max_load_factor, hash_func, NULL, kind);
+}
+
+/**
+ * This function creates a new hash table like table_init_kind, with a hash
+ * function that takes the length of the key. The keys of table_insert_n,
+ * table_lookup_n and table_delete_n are then hashed where they are, and
+ * the keys of table_insert, table_lookup and table_delete are hashed with
+ * their strlen as length. hash_wyhash_len and hash_crc32c_len are such
+ * functions.
+ *
+ * @param capacity initial capacity of the table
+ * @param max_load_factor the table grows when its load factor reaches this
+ * @param hash_func_n the function used for computing the hash value
+ * @param kind TABLE_CHAINED or TABLE_SWISS, optionally with TABLE_POW2,
+ * TABLE_BORROW and TABLE_CONCURRENT
+ * @return a pointer to the struct table that is allocated on the heap, NULL
+ * on failure
+ */
+struct table *table_init_n(unsigned long capacity, double max_load_factor,
+                           unsigned long (*hash_func_n)(const void *, size_t),
+                           int kind)
+{
+    if (hash_func_n == NULL)
+    {
+        return NULL;
+    }
+    return table_make(capacity, max_load_factor, NULL, hash_func_n, kind);
+}
+
+/**
+ * This function creates a new hash table, see table_init_kind and
+ * table_init_n.
+ *
+ * @param capacity initial capacity of the table
+ * @param max_load_factor the table grows when its load factor reaches this
+ * @param hash_func the function used for computing the hash value of a
+ * string, NULL if hash_func_n is used
+ * @param hash_func_n the function used for computing the hash value of a
+ * key with a length, NULL if hash_func is used
+ * @param kind the kind of table and its flags
+ * @return a pointer to the struct table that is allocated on the heap, NULL
+ * on failure
+ */
+static struct table *table_make(unsigned long capacity,
+                                double max_load_factor,
+                                unsigned long (*hash_func)(unsigned char *),
+                                unsigned long (*hash_func_n)(const void *,
+                                                             size_t),
+                                int kind)
 {
+    int pow2 = (kind & TABLE_POW2) != 0;
+    int concurrent = (kind & TABLE_CONCURRENT) != 0;
+    int borrow = (kind & TABLE_BORROW) != 0;
+    kind &= ~(TABLE_POW2 | TABLE_CONCURRENT | TABLE_BORROW);
+    if (kind != TABLE_CHAINED && kind != TABLE_SWISS)
+    {
+        return NULL;
+    }
     //! allocate hash table on the heap
     struct table *new_table = malloc(sizeof(struct table));
     //! return NULL if malloc failed
@@ -93,6 +767,57 @@ struct table *table_init(unsigned long capacity,
     {
         return NULL;
     }
+    new_table->array = NULL;
+    new_table->load = 0;
+    new_table->max_load_factor = max_load_factor;
+    new_table->hash_func = hash_func;
+    new_table->hash_func_n = hash_func_n;
+    new_table->kind = kind;
+    new_table->pow2 = pow2;
+    new_table->borrow = borrow;
+    new_table->ctrl = NULL;
+    new_table->slots = NULL;
+    new_table->growth_left = 0;
+    new_table->old_array = NULL;
+    new_table->old_capacity = 0;
+    new_table->rehash_index = 0;
+    new_table->shards = NULL;
+    if (concurrent)
+    {
+        //! return NULL if a shard could not be made and free hash table
+        if (shards_init(new_table, capacity,
+                        kind | (pow2 ? TABLE_POW2 : 0) |
+                            (borrow ? TABLE_BORROW : 0)) != 0)
+        {
+            free(new_table);
+            return NULL;
+        }
+        return new_table;
+    }
+    if (kind == TABLE_SWISS)
+    {
+        unsigned long slots = SWISS_GROUP;
+        while (slots < capacity)
+        {
+            slots *= 2;
+        }
+        //! return NULL if malloc failed and free hash table
+        if (swiss_alloc(new_table, slots) != 0)
+        {
+            free(new_table);
+            return NULL;
+        }
+        return new_table;
+    }
+    if (pow2)
+    {
+        unsigned long size = 1;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        capacity = size;
+    }
     //! allocate 2D array on the heap
     new_table->array = malloc(capacity * sizeof(struct node *));
     //! return NULL if malloc failed and free hash table
@@ -107,95 +832,133 @@ struct table *table_init(unsigned long capacity,
         new_table->array[i] = NULL;
     }
     new_table->capacity = capacity;
-    new_table->load = 0;
-    new_table->max_load_factor = max_load_factor;
-    new_table->hash_func = hash_func;
     return new_table;
 }
+
+struct table *table_init(unsigned long capacity,
+                         double max_load_factor,
+                         unsigned long (*hash_func)(unsigned char *))
+{
+    return table_init_kind(capacity, max_load_factor, hash_func,
+                           TABLE_CHAINED);
+}
+
+/* Helper function: Return the hash value of a key that is followed by a
+ * NUL, with the hash function of the table. */
+static unsigned long string_hash(struct table *t, const char *key,
+                                 size_t length)
+{
+    if (t->hash_func_n != NULL)
+    {
+        return t->hash_func_n(key, length);
+    }
+    return t->hash_func((unsigned char *)key);
+}
+
+/**
+ * This function computes the hash value of a key that need not be followed
+ * by a NUL, with the hash function of the table. The hash function of a
+ * table that was not made with table_init_n reads up to a NUL, so the key
+ * is hashed from a copy, which is on the stack if the key is short.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @param length length of the key
+ * @param hash_value the hash value is stored here
+ * @return 0 if successfull, 1 if there was no memory for the copy
+ */
+static int bytes_hash(struct table *t, const void *key, size_t length,
+                      unsigned long *hash_value)
+{
+    if (t->hash_func_n != NULL)
+    {
+        *hash_value = t->hash_func_n(key, length);
+        return 0;
+    }
+    char buffer[KEY_BUFFER];
+    char *copy = length < KEY_BUFFER ? buffer : malloc(length + 1);
+    if (copy == NULL)
+    {
+        return 1;
+    }
+    memcpy(copy, key, length);
+    copy[length] = '\0';
+    *hash_value = t->hash_func((unsigned char *)copy);
+    if (copy != buffer)
+    {
+        free(copy);
+    }
+    return 0;
+}
+
+/* Helper function: Return the shard of a concurrent table that holds the
+ * keys with the given hash value, locked. */
+static struct table *shard_lock(struct table *t, unsigned long hash_value)
+{
+    struct table *shard =
+        t->shards[hash_mix(hash_value) >> (64 - TABLE_SHARD_BITS)];
+    pthread_mutex_lock(&shard->lock);
+    return shard;
+}
+
 /**
- * This copies and inserts an array of characters as a key into the hash table,
- * together with the value, stored in a resizing integer array. If the key is
- * already present in the table, the value is appended to the existing array
- * instead. Returns 0 if successful and 1 otherwise.
- * table
+ * This function inserts a key with a known hash value into a table that is
+ * not concurrent, see table_insert.
  *
  * @param t the input hash table
  * @param key input key
+ * @param length length of the key
+ * @param hash_value hash value of the key given by the hash function
  * @param value input value
  * @return 0 if successfull else return 1
  */
-int table_insert(struct table *t, char *key, int value)
+static int insert_hashed(struct table *t, const char *key, size_t length,
+                         unsigned long hash_value, int value)
 {
-    if (t == NULL || key == NULL || t->array == NULL)
+    hash_value = table_hash(t, hash_value);
+    if (t->kind == TABLE_SWISS)
     {
-        return 1;
+        return swiss_insert(t, key, length, hash_value, value);
     }
-    //! calculate the hash value and index
-    if ((double)t->load / (double)t->capacity >= (double)t->max_load_factor)
+    if (t->array == NULL)
     {
-        resize(t);
+        return 1;
     }
-    unsigned long hash_value = t->hash_func((unsigned char *)key);
-    unsigned long hash_index = hash_value % t->capacity;
+    chained_step(t);
+    //! find the list of the key
+    struct node **head = table_bucket(t, hash_value);
     //! if index position of hash table is empty insert the node
-    if (t->array[hash_index] == NULL)
+    if (*head == NULL)
     {
-        //! malloc a new node on the heap, return NULL on failure
-        struct node *new_node = malloc(sizeof(struct node));
+        //! make a new node with the key and value, return 1 on failure
+        struct node *new_node =
+            make_node(key, length, hash_value, value, t->borrow);
         if (new_node == NULL)
         {
             return 1;
         }
-        //! malloc space on the heap to store the key
-        new_node->key = malloc((strlen(key) * sizeof(char) + 1));
-        if (new_node->key == NULL)
-        {
-            //! return NULL on failure and free node
-            free(new_node);
-            return 1;
-        }
-        //! copy the key
-        strcpy(new_node->key, key);
-        //! make an array and append the value to that array
-        new_node->value = array_init(5);
-        array_append(new_node->value, value);
-        t->array[hash_index] = new_node;
-        new_node->next = NULL;
+        *head = new_node;
         t->load++;
         return 0;
     }
-    struct node *tmp = t->array[hash_index];
+    struct node *tmp = *head;
     while (tmp != NULL)
     {
         //! if the key already exist, append the value to array of that node
-        if (strcmp(tmp->key, key) == 0)
+        if (node_match(tmp, key, hash_value, length))
         {
-            array_append(tmp->value, value);
-            return 0;
+            return array_append(tmp->value, value);
         }
         //! if the key does not exist in the hash table
         if (tmp->next == NULL)
         {
-            //! malloc a new node on the heap, return NULL on failure
-            struct node *new_node = malloc(sizeof(struct node));
+            //! make a new node with the key and value, return 1 on failure
+            struct node *new_node =
+                make_node(key, length, hash_value, value, t->borrow);
             if (new_node == NULL)
             {
                 return 1;
             }
-            //! malloc space on the heap to store the key
-            new_node->key = malloc((strlen(key) * sizeof(char) + 1));
-            if (new_node->key == NULL)
-            {
-                //! return NULL on failure and free node
-                free(new_node);
-                return 1;
-            }
-            //! copy the key
-            strcpy(new_node->key, key);
-            //! make an array and append the value to that array
-            new_node->value = array_init(5);
-            array_append(new_node->value, value);
-            new_node->next = NULL;
             //! add the node to the tail of the "link list"
             tmp->next = new_node;
             t->load++;
@@ -206,34 +969,97 @@ int table_insert(struct table *t, char *key, int value)
     return 1;
 }
 
+/* Helper function: Insert a key with a known hash value into a table, into
+ * the locked shard of the key if the table is concurrent. */
+static int insert_key(struct table *t, const char *key, size_t length,
+                      unsigned long hash_value, int value)
+{
+    if (t->shards == NULL)
+    {
+        return insert_hashed(t, key, length, hash_value, value);
+    }
+    struct table *shard = shard_lock(t, hash_value);
+    int result = insert_hashed(shard, key, length, hash_value, value);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
 /**
- * This function returns the array of all inserted integer values for the
- * specified key.
+ * This copies and inserts an array of characters as a key into the hash table,
+ * together with the value, stored in a resizing integer array. If the key is
+ * already present in the table, the value is appended to the existing array
+ * instead. Returns 0 if successful and 1 otherwise.
+ * table
+ *
+ * @param t the input hash table
+ * @param key input key
+ * @param value input value
+ * @return 0 if successfull else return 1
+ */
+int table_insert(struct table *t, char *key, int value)
+{
+    if (t == NULL || key == NULL)
+    {
+        return 1;
+    }
+    size_t length = strlen(key);
+    return insert_key(t, key, length, string_hash(t, key, length), value);
+}
+
+/**
+ * This function inserts a key of the given length into the hash table, like
+ * table_insert. The key may hold any bytes, NULs too, and need not be
+ * followed by a NUL, so it can be a slice of a larger buffer. Keys are
+ * compared with memcmp, a key inserted with table_insert is found by
+ * table_lookup_n with its strlen as length and the other way around.
+ *
+ * @param t the input hash table
+ * @param key input key
+ * @param length length of the key
+ * @param value input value
+ * @return 0 if successfull else return 1
+ */
+int table_insert_n(struct table *t, const void *key, size_t length,
+                   int value)
+{
+    unsigned long hash_value;
+    if (t == NULL || key == NULL || bytes_hash(t, key, length, &hash_value))
+    {
+        return 1;
+    }
+    return insert_key(t, key, length, hash_value, value);
+}
+
+/**
+ * This function looks up a key with a known hash value in a table that is
+ * not concurrent, see table_lookup.
  *
  * @param t the input hash table
  * @param key the input key
+ * @param length length of the key
+ * @param hash_value hash value of the key given by the hash function
  * @return struct array for that specified key
  */
-struct array *table_lookup(struct table *t, char *key)
+static struct array *lookup_hashed(struct table *t, const char *key,
+                                   size_t length, unsigned long hash_value)
 {
-    //! if t is NULL or 2D array of hash table is NULL or key is NULL
-    if (t == NULL || t->array == NULL || key == NULL)
+    hash_value = table_hash(t, hash_value);
+    if (t->kind == TABLE_SWISS)
     {
-        return NULL;
+        unsigned long i = swiss_find(t, key, hash_value, length);
+        return i == t->capacity ? NULL : t->slots[i].node->value;
     }
-    //! calculate the hash value and index
-    unsigned long hash_value = t->hash_func((unsigned char *)key);
-    unsigned long hash_index = hash_value % t->capacity;
-    //! if the index position of hash table is empty return NULL
-    if (t->array[hash_index] == NULL)
+    //! if 2D array of hash table is NULL
+    if (t->array == NULL)
     {
         return NULL;
     }
-    struct node *tmp = t->array[hash_index];
+    //! find the list of the key
+    struct node *tmp = *table_bucket(t, hash_value);
     while (tmp != NULL)
     {
         //! if the key is found, return the array
-        if (strcmp(tmp->key, key) == 0)
+        if (node_match(tmp, key, hash_value, length))
         {
             return tmp->value;
         }
@@ -243,6 +1069,59 @@ struct array *table_lookup(struct table *t, char *key)
     return NULL;
 }
 
+/* Helper function: Look up a key with a known hash value in a table, in the
+ * locked shard of the key if the table is concurrent. */
+static struct array *lookup_key(struct table *t, const char *key,
+                                size_t length, unsigned long hash_value)
+{
+    if (t->shards == NULL)
+    {
+        return lookup_hashed(t, key, length, hash_value);
+    }
+    struct table *shard = shard_lock(t, hash_value);
+    struct array *result = lookup_hashed(shard, key, length, hash_value);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/**
+ * This function returns the array of all inserted integer values for the
+ * specified key.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @return struct array for that specified key
+ */
+struct array *table_lookup(struct table *t, char *key)
+{
+    //! if t is NULL or key is NULL
+    if (t == NULL || key == NULL)
+    {
+        return NULL;
+    }
+    size_t length = strlen(key);
+    return lookup_key(t, key, length, string_hash(t, key, length));
+}
+
+/**
+ * This function returns the array of all inserted integer values for a key
+ * of the given length, see table_insert_n.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @param length length of the key
+ * @return struct array for that specified key
+ */
+struct array *table_lookup_n(struct table *t, const void *key, size_t length)
+{
+    unsigned long hash_value;
+    if (t == NULL || key == NULL || bytes_hash(t, key, length, &hash_value))
+    {
+        return NULL;
+    }
+    return lookup_key(t, key, length, hash_value);
+}
+
 /**
  * This funcction returns the load factor of the hash table. The load factor is
  * defined as: number of elements stored / size of hash table.
@@ -252,58 +1131,85 @@ struct array *table_lookup(struct table *t, char *key)
  */
 double table_load_factor(struct table *t)
 {
-    if (t == NULL || t->array == NULL)
+    if (t != NULL && t->shards != NULL)
+    {
+        unsigned long load = 0;
+        unsigned long capacity = 0;
+        //! add up the shards one at a time
+        for (int i = 0; i < TABLE_SHARDS; i++)
+        {
+            pthread_mutex_lock(&t->shards[i]->lock);
+            load += t->shards[i]->load;
+            capacity += t->shards[i]->capacity;
+            pthread_mutex_unlock(&t->shards[i]->lock);
+        }
+        return (double)load / (double)capacity;
+    }
+    if (t == NULL || (t->array == NULL && t->slots == NULL))
     {
         return -1;
     }
-    return (double)(t->load / t->capacity);
+    return (double)t->load / (double)t->capacity;
 }
 
 /**
- * This function removes the specified key and associated value from the
- * hash table.
+ * This function removes a key with a known hash value from a table that is
+ * not concurrent, see table_delete.
  *
  * @param t the input hash table
  * @param key the input key
+ * @param length length of the key
+ * @param hash_value hash value of the key given by the hash function
  * @return 0 if key was removed, 1 if the key was not present in the hash table
  */
-int table_delete(struct table *t, char *key)
+static int delete_hashed(struct table *t, const char *key, size_t length,
+                         unsigned long hash_value)
 {
-    //! if t is NULL or 2D array of hash table is NULL or key is NULL
-    if (t == NULL || t->array == NULL || key == NULL)
+    hash_value = table_hash(t, hash_value);
+    if (t->kind == TABLE_SWISS)
+    {
+        return swiss_delete(t, key, length, hash_value);
+    }
+    //! if 2D array of hash table is NULL
+    if (t->array == NULL)
+    {
+        return 1;
+    }
+    //! move a part of the rehash that is in progress
+    if (t->old_array != NULL)
+    {
+        rehash_step(t, REHASH_STEP);
+    }
+    //! find the list of the key
+    struct node **head = table_bucket(t, hash_value);
+    //! if the list is empty the key is not present
+    if (*head == NULL)
     {
         return 1;
     }
-    //! calculate the hash value and index
-    unsigned long hash_value = t->hash_func((unsigned char *)key);
-    unsigned long hash_index = hash_value % t->capacity;
     //! if the head node has to be deleted
-    if (strcmp(t->array[hash_index]->key, key) == 0)
+    if (node_match(*head, key, hash_value, length))
     {
         //! free the head node and let the next node be the head node.
-        struct node *tmp = t->array[hash_index];
-        t->array[hash_index] = t->array[hash_index]->next;
+        struct node *tmp = *head;
+        *head = tmp->next;
         tmp->next = NULL;
-        free(tmp->key);
-        array_cleanup(tmp->value);
-        free(tmp);
+        free_node(tmp);
         t->load--;
         return 0;
     }
-    struct node *tmp = t->array[hash_index];
+    struct node *tmp = *head;
     while (tmp->next != NULL)
     {
         //! if the next node has to be deleted
-        if (strcmp(tmp->next->key, key) == 0)
+        if (node_match(tmp->next, key, hash_value, length))
         {
             //! let current node point to the node after the next node
             struct node *delete = tmp->next;
             tmp->next = delete->next;
             delete->next = NULL;
             //! free the next node
-            free(delete->key);
-            array_cleanup(delete->value);
-            free(delete);
+            free_node(delete);
             t->load--;
             return 0;
         }
@@ -313,22 +1219,370 @@ int table_delete(struct table *t, char *key)
     return 1;
 }
 
+/* Helper function: Remove a key with a known hash value from a table, from
+ * the locked shard of the key if the table is concurrent. */
+static int delete_key(struct table *t, const char *key, size_t length,
+                      unsigned long hash_value)
+{
+    if (t->shards == NULL)
+    {
+        return delete_hashed(t, key, length, hash_value);
+    }
+    struct table *shard = shard_lock(t, hash_value);
+    int result = delete_hashed(shard, key, length, hash_value);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/**
+ * This function removes the specified key and associated value from the
+ * hash table.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @return 0 if key was removed, 1 if the key was not present in the hash table
+ */
+int table_delete(struct table *t, char *key)
+{
+    //! if t is NULL or key is NULL
+    if (t == NULL || key == NULL)
+    {
+        return 1;
+    }
+    size_t length = strlen(key);
+    return delete_key(t, key, length, string_hash(t, key, length));
+}
+
+/**
+ * This function removes a key of the given length and its values from the
+ * hash table, see table_insert_n.
+ *
+ * @param t the input hash table
+ * @param key the input key
+ * @param length length of the key
+ * @return 0 if key was removed, 1 if the key was not present in the hash table
+ */
+int table_delete_n(struct table *t, const void *key, size_t length)
+{
+    unsigned long hash_value;
+    if (t == NULL || key == NULL || bytes_hash(t, key, length, &hash_value))
+    {
+        return 1;
+    }
+    return delete_key(t, key, length, hash_value);
+}
+
+/**
+ * This function moves a node of another table into a table of the same kind.
+ * If the key is already present the values of the node are added to the end
+ * of its array and the node is freed, otherwise the node itself is linked in.
+ * The stored hash value of the node is used, so its key is not hashed again.
+ *
+ * @param t the input hash table, not concurrent
+ * @param n the node, with the hash value a table of this kind keeps
+ * @return 0 if successfull, 1 if the values of the node were lost
+ */
+static int merge_node(struct table *t, struct node *n)
+{
+    if (t->kind == TABLE_SWISS)
+    {
+        unsigned long i = swiss_find(t, n->key, n->hash, n->length);
+        if (i == t->capacity)
+        {
+            if (swiss_add(t, n) == 0)
+            {
+                return 0;
+            }
+            free_node(n);
+            return 1;
+        }
+        int result = array_extend(t->slots[i].node->value, n->value);
+        free_node(n);
+        return result;
+    }
+    chained_step(t);
+    struct node **head = table_bucket(t, n->hash);
+    struct node *tmp = *head;
+    while (tmp != NULL && !node_match(tmp, n->key, n->hash, n->length))
+    {
+        tmp = tmp->next;
+    }
+    //! push a new key on the front of its list
+    if (tmp == NULL)
+    {
+        n->next = *head;
+        *head = n;
+        t->load++;
+        return 0;
+    }
+    int result = array_extend(tmp->value, n->value);
+    free_node(n);
+    return result;
+}
+
+/**
+ * This function moves all keys of a table into another table of the same
+ * kind, see table_merge. The second table is left empty.
+ *
+ * @param t the input hash table, not concurrent
+ * @param src the table whose keys are moved, not concurrent
+ * @return 0 if successfull, 1 if some values were lost
+ */
+static int merge_plain(struct table *t, struct table *src)
+{
+    int result = 0;
+    if (src->kind == TABLE_SWISS)
+    {
+        for (unsigned long i = 0; i < src->capacity; i++)
+        {
+            if ((src->ctrl[i] & 0x80) == 0)
+            {
+                result |= merge_node(t, src->slots[i].node);
+            }
+        }
+        memset(src->ctrl, SWISS_EMPTY, src->capacity);
+        src->load = 0;
+        src->growth_left = swiss_limit(src, src->capacity);
+        return result;
+    }
+    //! move the rest of a rehash that is in progress
+    rehash_step(src, src->old_capacity);
+    for (unsigned long i = 0; i < src->capacity; i++)
+    {
+        while (src->array[i] != NULL)
+        {
+            struct node *tmp = src->array[i];
+            src->array[i] = tmp->next;
+            result |= merge_node(t, tmp);
+        }
+    }
+    src->load = 0;
+    return result;
+}
+
+/**
+ * This function takes all nodes out of a table that is not concurrent and
+ * links them into one list per shard of a concurrent table of the same
+ * kind, through their next pointers. The table is left empty.
+ *
+ * @param t the concurrent table
+ * @param src the table whose nodes are taken, not concurrent
+ * @param lists TABLE_SHARDS lists that the nodes are pushed on
+ */
+static void merge_route(struct table *t, struct table *src,
+                        struct node **lists)
+{
+    struct node *tmp = NULL;
+    if (src->kind == TABLE_CHAINED)
+    {
+        //! move the rest of a rehash that is in progress
+        rehash_step(src, src->old_capacity);
+    }
+    for (unsigned long i = 0; i < src->capacity; i++)
+    {
+        if (src->kind == TABLE_SWISS)
+        {
+            tmp = (src->ctrl[i] & 0x80) == 0 ? src->slots[i].node : NULL;
+            if (tmp != NULL)
+            {
+                tmp->next = NULL;
+            }
+        }
+        else
+        {
+            tmp = src->array[i];
+            src->array[i] = NULL;
+        }
+        while (tmp != NULL)
+        {
+            struct node *next = tmp->next;
+            //! the shard is taken from the hash value the way shard_lock
+            //! does, a chained table without TABLE_POW2 keeps it unmixed
+            uint64_t hash_value = t->kind == TABLE_SWISS || t->pow2
+                                      ? tmp->hash
+                                      : hash_mix(tmp->hash);
+            int shard = (int)(hash_value >> (64 - TABLE_SHARD_BITS));
+            tmp->next = lists[shard];
+            lists[shard] = tmp;
+            tmp = next;
+        }
+    }
+    if (src->kind == TABLE_SWISS)
+    {
+        memset(src->ctrl, SWISS_EMPTY, src->capacity);
+        src->growth_left = swiss_limit(src, src->capacity);
+    }
+    src->load = 0;
+}
+
+/**
+ * Struct merge_task
+ * @param t the concurrent table that is merged into
+ * @param src the concurrent table that is merged from, NULL if lists is used
+ * @param lists one list of nodes per shard that is merged, see merge_route
+ * @param first the first shard this task merges
+ * @param step the task merges every step-th shard from first on
+ * @param result 0 if successfull, 1 if some values were lost
+ */
+struct merge_task
+{
+    struct table *t;
+    struct table *src;
+    struct node **lists;
+    int first;
+    int step;
+    int result;
+};
+
+/* Helper function: Merge the shards of a merge_task, as a thread. */
+static void *merge_task_run(void *arg)
+{
+    struct merge_task *task = arg;
+    for (int i = task->first; i < TABLE_SHARDS; i += task->step)
+    {
+        struct table *shard = task->t->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (task->src != NULL)
+        {
+            task->result |= merge_plain(shard, task->src->shards[i]);
+        }
+        //! merge_node changes the next pointer of the node
+        for (struct node *tmp = task->lists[i]; tmp != NULL;)
+        {
+            struct node *next = tmp->next;
+            task->result |= merge_node(shard, tmp);
+            tmp = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return NULL;
+}
+
+/**
+ * This function moves all keys and values of the second table into the
+ * first one and cleans up the second table. The values of a key that is in
+ * both tables are added after the values it already has. Nodes are moved,
+ * not copied, and no key is hashed again. Both tables must have been made
+ * with the same kind, flags and hash function, except that a table that is
+ * not concurrent can be merged into a concurrent one. Its nodes are then
+ * divided over the shards first. A concurrent table is merged into one
+ * shard per thread at a time, with as many threads as there are processors.
+ * Other threads may use the first table during the merge, but not the
+ * second.
+ *
+ * @param t the input hash table
+ * @param src the table whose keys are moved, it is cleaned up if it matches
+ * @return 0 if successfull, 1 if the tables do not match, in which case
+ * nothing is changed, or if some values were lost for lack of memory
+ */
+int table_merge(struct table *t, struct table *src)
+{
+    if (t == NULL || src == NULL || t == src || t->kind != src->kind ||
+        t->pow2 != src->pow2 || t->borrow != src->borrow ||
+        t->hash_func != src->hash_func || t->hash_func_n != src->hash_func_n ||
+        (t->shards == NULL && src->shards != NULL))
+    {
+        return 1;
+    }
+    int result = 0;
+    if (t->shards == NULL)
+    {
+        //! a chained table without an array cannot take any keys
+        if (t->kind == TABLE_CHAINED && t->array == NULL)
+        {
+            return 1;
+        }
+        result = merge_plain(t, src);
+        table_cleanup(src);
+        return result;
+    }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (threads > TABLE_SHARDS)
+    {
+        threads = TABLE_SHARDS;
+    }
+    struct node *lists[TABLE_SHARDS] = {NULL};
+    struct merge_task tasks[TABLE_SHARDS];
+    pthread_t thread[TABLE_SHARDS];
+    int forked[TABLE_SHARDS];
+    if (src->shards == NULL)
+    {
+        merge_route(t, src, lists);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        tasks[i] = (struct merge_task){
+            t, src->shards == NULL ? NULL : src, lists, i, (int)threads, 0};
+        //! the first task runs on this thread, as does a task that could
+        //! not get a thread of its own
+        forked[i] = i > 0 && pthread_create(&thread[i], NULL, merge_task_run,
+                                            &tasks[i]) == 0;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (!forked[i])
+        {
+            merge_task_run(&tasks[i]);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (forked[i])
+        {
+            pthread_join(thread[i], NULL);
+        }
+        result |= tasks[i].result;
+    }
+    table_cleanup(src);
+    return result;
+}
+
 /**
- * This function cleans up the hash table data structure.
+ * This function cleans up the hash table data structure. A concurrent table
+ * must no longer be used by other threads.
  *
  * @param t input hash table
  */
 void table_cleanup(struct table *t)
 {
+    if (t->shards != NULL)
+    {
+        for (int i = 0; i < TABLE_SHARDS; i++)
+        {
+            pthread_mutex_destroy(&t->shards[i]->lock);
+            table_cleanup(t->shards[i]);
+        }
+        free(t->shards);
+        free(t);
+        return;
+    }
+    if (t->kind == TABLE_SWISS)
+    {
+        for (unsigned long i = 0; i < t->capacity; i++)
+        {
+            if ((t->ctrl[i] & 0x80) == 0)
+            {
+                free_node(t->slots[i].node);
+            }
+        }
+        free(t->ctrl);
+        free(t->slots);
+        free(t);
+        return;
+    }
+    //! move the rest of a rehash that is in progress
+    rehash_step(t, t->old_capacity);
     for (size_t i = 0; i < t->capacity; i++)
     {
         while (t->array[i] != NULL)
         {
             struct node *tmp = t->array[i];
             t->array[i] = tmp->next;
-            free(tmp->key);
-            array_cleanup(tmp->value);
-            free(tmp);
+            free_node(tmp);
         }
     }
     free(t->array);
@@ -0,0 +1,58 @@
+/**
+ * hash_table.h:
+ * The hash table API of hash_table.c, and the inverted index builder of
+ * index.c that is built on it.
+ *
+*/
+
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stddef.h>
+
+/* Kinds of table, selected with table_init_kind. */
+#define TABLE_CHAINED 0
+#define TABLE_SWISS 1
+
+/* Flag that can be added to the kind of table_init_kind to give a chained
+ * table power-of-two capacities, so that an index is a mask of the mixed
+ * hash value instead of a division. Swiss tables always work this way. */
+#define TABLE_POW2 4
+
+/* Flag that can be added to the kind of table_init_kind to make a table that
+ * can be shared between threads. */
+#define TABLE_CONCURRENT 8
+
+/* Flag that can be added to the kind of table_init_kind to make a table that
+ * borrows its keys instead of copying them. */
+#define TABLE_BORROW 16
+
+struct table;
+struct array;
+
+struct table *table_init(unsigned long capacity,
+                         double max_load_factor,
+                         unsigned long (*hash_func)(unsigned char *));
+struct table *table_init_kind(unsigned long capacity,
+                              double max_load_factor,
+                              unsigned long (*hash_func)(unsigned char *),
+                              int kind);
+struct table *table_init_n(unsigned long capacity, double max_load_factor,
+                           unsigned long (*hash_func_n)(const void *, size_t),
+                           int kind);
+int table_insert(struct table *t, char *key, int value);
+int table_insert_n(struct table *t, const void *key, size_t length,
+                   int value);
+struct array *table_lookup(struct table *t, char *key);
+struct array *table_lookup_n(struct table *t, const void *key, size_t length);
+double table_load_factor(struct table *t);
+int table_delete(struct table *t, char *key);
+int table_delete_n(struct table *t, const void *key, size_t length);
+int table_merge(struct table *t, struct table *src);
+void table_cleanup(struct table *t);
+
+struct table *index_build(const char *path, int threads,
+                          unsigned long (*hash_func_n)(const void *, size_t),
+                          int kind);
+
+#endif
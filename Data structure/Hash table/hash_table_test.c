@@ -0,0 +1,483 @@
+/**
+ * hash_table_test.c:
+ * Regression tests for hash_table.c, hash_func.c, array.c and index.c.
+ * Build it together with them and run it, it prints "ok" if all tests
+ * pass.
+ *
+*/
+
+/* rand_r is POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+#include "hash_func.h"
+#include "hash_table.h"
+
+/* Number of random operations per key of a test. */
+#define TEST_ROUNDS 8
+
+/* Number of threads that share a concurrent table, and number of keys each
+ * of them inserts. */
+#define TEST_THREADS 8
+#define TEST_SHARED 20000
+
+/* File the index test writes, and its number of lines before the last
+ * one, which has no newline. */
+#define TEST_FILE "hash_table_test.txt"
+#define TEST_LINES 6000
+
+/* Number of keys of the length-aware test, and length of its long key. */
+#define TEST_BYTES 20000
+#define TEST_LONG 300
+
+/* Helper function: Return hash_function with its low 24 bits cleared, so a
+ * table that masks the raw hash value would put every key in one index. */
+static unsigned long hash_high(unsigned char *key)
+{
+    return (unsigned long)hash_function(key) << 24;
+}
+
+/* A table follows random inserts, deletes and lookups of the keys "key-0"
+ * up to "key-(n - 1)", next to a count of the values of every key. Every
+ * result must agree with the counts, and in the end every key must be
+ * found exactly when its count is not 0. */
+static void check_random_ops(struct table *t, int n, unsigned int seed)
+{
+    int *counts = calloc((size_t)n, sizeof(int));
+    assert(t != NULL && counts != NULL);
+    char key[32];
+    for (int step = 0; step < n * TEST_ROUNDS; step++)
+    {
+        int x = rand_r(&seed) % n;
+        sprintf(key, "key-%d", x);
+        switch (rand_r(&seed) % 3)
+        {
+        case 0:
+            assert(table_insert(t, key, x) == 0);
+            counts[x]++;
+            break;
+        case 1:
+            assert(table_delete(t, key) == (counts[x] > 0 ? 0 : 1));
+            counts[x] = 0;
+            break;
+        default:
+        {
+            struct array *values = table_lookup(t, key);
+            if (counts[x] > 0)
+            {
+                assert(values != NULL);
+                assert(array_size(values) == (unsigned long)counts[x]);
+                assert(array_get(values, 0) == x);
+            }
+            else
+            {
+                assert(values == NULL);
+            }
+            break;
+        }
+        }
+    }
+    for (int x = 0; x < n; x++)
+    {
+        sprintf(key, "key-%d", x);
+        assert((table_lookup(t, key) != NULL) == (counts[x] > 0));
+    }
+    free(counts);
+}
+
+/* Swiss tables probe groups of slots and leave tombstones behind deleted
+ * keys. hash_too_simple hashes every key to the same value, so all of them
+ * share one probe sequence and every lookup must step over the tombstones
+ * of the others. A tiny load factor makes the table grow on every insert.
+ * Kinds that do not exist are refused. */
+static void test_swiss(void)
+{
+    struct table *t = table_init_kind(1, 0.875, hash_function, TABLE_SWISS);
+    check_random_ops(t, 20000, 1);
+    table_cleanup(t);
+    t = table_init_kind(1, 0.875, hash_too_simple, TABLE_SWISS);
+    check_random_ops(t, 2000, 2);
+    table_cleanup(t);
+    t = table_init_kind(10, 0.01, hash_function, TABLE_SWISS);
+    check_random_ops(t, 1000, 3);
+    table_cleanup(t);
+    assert(table_init_kind(10, 1, hash_function, 3) == NULL);
+}
+
+/* A chained table moves its lists from the old array to the new one a few
+ * at a time, so most operations of a test that starts with a capacity of 1
+ * run while a rehash is going on, and find keys in either array. With a
+ * load factor below 1/8 a rehash is still running when the table must grow
+ * again. After every insert of a growing table, the first key and the key
+ * inserted before it must still be found. */
+static void test_rehash(void)
+{
+    const double load_factors[] = {0.05, 0.75, 3.0};
+    for (int i = 0; i < 3; i++)
+    {
+        struct table *t = table_init(1, load_factors[i], hash_function);
+        check_random_ops(t, 20000, (unsigned int)i + 1);
+        table_cleanup(t);
+    }
+    struct table *t = table_init(1, 1.0, hash_function);
+    assert(t != NULL && table_delete(t, "nothing") == 1);
+    char key[32];
+    for (int x = 0; x < 20000; x++)
+    {
+        sprintf(key, "key-%d", x);
+        assert(table_insert(t, key, x) == 0);
+        assert(array_get(table_lookup(t, "key-0"), 0) == 0);
+        sprintf(key, "key-%d", x / 2);
+        assert(array_get(table_lookup(t, key), 0) == x / 2);
+    }
+    for (int x = 0; x < 20000; x += 2)
+    {
+        sprintf(key, "key-%d", x);
+        assert(table_delete(t, key) == 0);
+    }
+    for (int x = 0; x < 20000; x++)
+    {
+        sprintf(key, "key-%d", x);
+        assert((table_lookup(t, key) != NULL) == (x % 2 == 1));
+    }
+    table_cleanup(t);
+}
+
+/* TABLE_POW2 masks the mixed hash value instead of dividing. Keys whose
+ * hash values differ only in their high bits, or not at all, must work with
+ * it on both kinds of table, as must the plain chained table next to it.
+ * Flag 2 does not exist and is refused. */
+static void test_pow2(void)
+{
+    const int kinds[] = {TABLE_CHAINED | TABLE_POW2, TABLE_SWISS | TABLE_POW2,
+                         TABLE_CHAINED};
+    for (int k = 0; k < 3; k++)
+    {
+        struct table *t = table_init_kind(3, 0.75, hash_function, kinds[k]);
+        check_random_ops(t, 20000, (unsigned int)k + 1);
+        table_cleanup(t);
+        t = table_init_kind(3, 0.75, hash_high, kinds[k]);
+        check_random_ops(t, 20000, (unsigned int)k + 4);
+        table_cleanup(t);
+        t = table_init_kind(3, 0.75, hash_too_simple, kinds[k]);
+        check_random_ops(t, 2000, (unsigned int)k + 7);
+        table_cleanup(t);
+    }
+    assert(table_init_kind(3, 1, hash_function, 2) == NULL);
+}
+
+/**
+ * Thread of the concurrent tests
+ * @param t the shared table
+ * @param id number of the thread
+ */
+struct test_thread
+{
+    struct table *t;
+    int id;
+};
+
+/* Helper function: Add the id of the thread to the shared keys "k0" up to
+ * "k(TEST_SHARED - 1)". Insert keys of its own, "own<id>-<i>" with value
+ * i, look some of them up and delete every fifth one again. */
+static void *thread_run(void *arg)
+{
+    struct test_thread *thread = arg;
+    char key[32];
+    for (int i = 0; i < TEST_SHARED; i++)
+    {
+        sprintf(key, "k%d", i);
+        assert(table_insert(thread->t, key, thread->id) == 0);
+        sprintf(key, "own%d-%d", thread->id, i);
+        assert(table_insert(thread->t, key, i) == 0);
+        if (i % 3 == 0)
+        {
+            sprintf(key, "own%d-%d", thread->id, i / 2);
+            struct array *values = table_lookup(thread->t, key);
+            assert(values != NULL || (i / 2) % 5 == 0);
+        }
+        if (i % 5 == 0)
+        {
+            sprintf(key, "own%d-%d", thread->id, i);
+            assert(table_delete(thread->t, key) == 0);
+        }
+    }
+    return NULL;
+}
+
+/* TEST_THREADS threads share a table made with TABLE_CONCURRENT, of every
+ * kind with and without TABLE_POW2, and insert, look up and delete keys
+ * that all threads use as well as keys of their own. Afterwards every
+ * shared key holds one value per thread and every own key is found
+ * exactly when it was not deleted. The unknown flag 2 is refused here too.
+ * Built with -fsanitize=thread it also checks for data races. */
+static void test_concurrent(void)
+{
+    for (int kind = TABLE_CHAINED; kind <= TABLE_SWISS; kind++)
+    {
+        for (int pow2 = 0; pow2 <= TABLE_POW2; pow2 += TABLE_POW2)
+        {
+            struct table *t = table_init_kind(16, kind ? 0.875 : 1.0,
+                                              hash_function,
+                                              kind | pow2 | TABLE_CONCURRENT);
+            assert(t != NULL);
+            struct test_thread threads[TEST_THREADS];
+            pthread_t ids[TEST_THREADS];
+            for (int i = 0; i < TEST_THREADS; i++)
+            {
+                threads[i] = (struct test_thread){t, i};
+                assert(pthread_create(&ids[i], NULL, thread_run,
+                                      &threads[i]) == 0);
+            }
+            for (int i = 0; i < TEST_THREADS; i++)
+            {
+                assert(pthread_join(ids[i], NULL) == 0);
+            }
+            char key[32];
+            for (int i = 0; i < TEST_SHARED; i++)
+            {
+                sprintf(key, "k%d", i);
+                struct array *values = table_lookup(t, key);
+                assert(array_size(values) == TEST_THREADS);
+                for (int id = 0; id < TEST_THREADS; id++)
+                {
+                    sprintf(key, "own%d-%d", id, i);
+                    values = table_lookup(t, key);
+                    assert((values == NULL) == (i % 5 == 0));
+                    assert(values == NULL || array_get(values, 0) == i);
+                }
+            }
+            table_cleanup(t);
+        }
+    }
+    assert(table_init_kind(10, 1, hash_function, 3 | TABLE_CONCURRENT) ==
+           NULL);
+}
+
+/* table_merge adds the values of a key that is in both tables after the
+ * ones the first table has, also when a table that is not concurrent is
+ * merged into a concurrent one. Tables of different kinds are refused and
+ * left as they were. */
+static void test_merge(void)
+{
+    const int kinds[] = {TABLE_CHAINED, TABLE_SWISS, TABLE_CHAINED,
+                         TABLE_SWISS | TABLE_POW2};
+    const int concurrent[] = {0, 0, TABLE_CONCURRENT, TABLE_CONCURRENT};
+    char key[32];
+    for (int k = 0; k < 4; k++)
+    {
+        struct table *t = table_init_kind(4, 0.75, hash_function,
+                                          kinds[k] | concurrent[k]);
+        struct table *src = table_init_kind(4, 0.75, hash_function, kinds[k]);
+        assert(t != NULL && src != NULL);
+        for (int i = 0; i < 3000; i++)
+        {
+            sprintf(key, "key-%d", i);
+            assert(i % 3 == 2 || table_insert(t, key, i) == 0);
+            assert(i % 3 == 0 || table_insert(src, key, -i) == 0);
+        }
+        struct table *other = table_init_kind(4, 0.75, hash_function,
+                                              kinds[k] ^ TABLE_SWISS);
+        assert(table_merge(t, other) == 1);
+        table_cleanup(other);
+        assert(table_merge(t, src) == 0);
+        for (int i = 0; i < 3000; i++)
+        {
+            sprintf(key, "key-%d", i);
+            struct array *values = table_lookup(t, key);
+            assert(array_size(values) == (i % 3 == 1 ? 2u : 1u));
+            assert(array_get(values, 0) == (i % 3 == 2 ? -i : i));
+            assert(i % 3 != 1 || array_get(values, 1) == -i);
+        }
+        table_cleanup(t);
+    }
+}
+
+/* Helper function: Check that a word of the index occurs on the lines
+ * first, first + step and so on up to last, except on every tenth line,
+ * and times times on each of them. */
+static void check_word(struct table *index, char *word, int first, int step,
+                       int last, int times)
+{
+    struct array *values = table_lookup(index, word);
+    unsigned long i = 0;
+    for (int line = first; line <= last; line += step)
+    {
+        for (int j = 0; j < times && line % 10 != 0; j++)
+        {
+            assert(array_get(values, i) == line);
+            i++;
+        }
+    }
+    assert(array_size(values) == i);
+}
+
+/* index_build numbers the lines of every chunk from the number of newlines
+ * in the chunks before it. A file of TEST_LINES lines, with every tenth one
+ * empty and a last line without a newline, is indexed with 1 up to 8
+ * threads. Every word must list its lines in order, as if one thread read
+ * the whole file. */
+static void test_index(void)
+{
+    FILE *file = fopen(TEST_FILE, "w");
+    assert(file != NULL);
+    for (int line = 1; line <= TEST_LINES; line++)
+    {
+        if (line % 10 != 0)
+        {
+            fprintf(file, "line%d w%d common, common", line, line % 97);
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, "last");
+    assert(fclose(file) == 0);
+    const int kinds[] = {TABLE_CHAINED, TABLE_SWISS,
+                         TABLE_CHAINED | TABLE_POW2, TABLE_SWISS | TABLE_POW2};
+    for (int k = 0; k < 4; k++)
+    {
+        for (int threads = 1; threads <= 8; threads++)
+        {
+            struct table *index =
+                index_build(TEST_FILE, threads, hash_wyhash_len, kinds[k]);
+            assert(index != NULL);
+            check_word(index, "common", 1, 1, TEST_LINES, 2);
+            check_word(index, "w5", 5, 97, TEST_LINES, 1);
+            check_word(index, "line4321", 4321, 1, 4321, 1);
+            check_word(index, "last", TEST_LINES + 1, 1, TEST_LINES + 1, 1);
+            assert(table_lookup(index, "line6000") == NULL);
+            table_cleanup(index);
+        }
+    }
+    remove(TEST_FILE);
+}
+
+/* Helper function: Check the keys of the length-aware test in a table.
+ * Keys of the string API are also inserted unless the table borrows its
+ * keys. Every second key is deleted at the end. */
+static void check_bytes(struct table *t, const char *text,
+                        const size_t *offsets, const size_t *lengths,
+                        int borrow)
+{
+    char key[32];
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < TEST_BYTES; i++)
+        {
+            assert(table_insert_n(t, text + offsets[i], lengths[i],
+                                  i + round) == 0);
+        }
+    }
+    const char *long_key = text + offsets[TEST_BYTES - 1] +
+                           lengths[TEST_BYTES - 1];
+    assert(table_insert_n(t, long_key, TEST_LONG, 7) == 0);
+    assert(table_insert_n(t, long_key, TEST_LONG - 1, 8) == 0);
+    for (int i = 0; i < TEST_BYTES; i++)
+    {
+        struct array *values =
+            table_lookup_n(t, text + offsets[i], lengths[i]);
+        assert(array_size(values) == 2);
+        assert(array_get(values, 0) == i && array_get(values, 1) == i + 1);
+        //! a key with a NUL is not found by its part before the NUL
+        sprintf(key, "k%d", i);
+        values = table_lookup(t, key);
+        assert(i % 4 == 0 ? values == NULL : array_get(values, 0) == i);
+    }
+    assert(array_get(table_lookup_n(t, long_key, TEST_LONG), 0) == 7);
+    assert(array_get(table_lookup_n(t, long_key, TEST_LONG - 1), 0) == 8);
+    assert(table_lookup_n(t, long_key, TEST_LONG - 2) == NULL);
+    for (int i = 0; i < 1000 && !borrow; i++)
+    {
+        sprintf(key, "s%d", i);
+        assert(table_insert(t, key, i) == 0);
+    }
+    for (int i = 0; i < 1000 && !borrow; i++)
+    {
+        sprintf(key, "s%d", i);
+        assert(array_get(table_lookup_n(t, key, strlen(key)), 0) == i);
+        assert(table_delete_n(t, key, strlen(key)) == 0);
+        assert(table_lookup(t, key) == NULL);
+    }
+    for (int i = 0; i < TEST_BYTES; i += 2)
+    {
+        assert(table_delete_n(t, text + offsets[i], lengths[i]) == 0);
+    }
+    for (int i = 0; i < TEST_BYTES; i++)
+    {
+        assert((table_lookup_n(t, text + offsets[i], lengths[i]) != NULL) ==
+               (i % 2 == 1));
+    }
+    //! the empty key is a key like any other
+    assert(table_delete_n(t, text, 0) == 1);
+    assert(table_insert_n(t, text, 0, 5) == 0);
+    assert(table_lookup_n(t, "", 0) != NULL && table_lookup(t, "") != NULL);
+}
+
+/* The _n functions take keys of any bytes. The keys "k<i>" lie side by side
+ * in one buffer without NULs between them, and every fourth one is
+ * followed by a NUL and a 'z' that belong to the key. Every kind, with and
+ * without TABLE_CONCURRENT and TABLE_BORROW, and tables of table_init_n as
+ * well as table_init_kind, must find them, a long key and its prefixes
+ * apart, and the keys of the string API. A table without a hash function
+ * is refused. */
+static void test_bytes(void)
+{
+    char *text = malloc((size_t)TEST_BYTES * 16 + TEST_LONG);
+    size_t *offsets = malloc(TEST_BYTES * sizeof(size_t));
+    size_t *lengths = malloc(TEST_BYTES * sizeof(size_t));
+    assert(text != NULL && offsets != NULL && lengths != NULL);
+    size_t position = 0;
+    for (int i = 0; i < TEST_BYTES; i++)
+    {
+        offsets[i] = position;
+        int length = sprintf(text + position, "k%d", i);
+        if (i % 4 == 0)
+        {
+            text[position + length] = '\0';
+            text[position + length + 1] = 'z';
+            length += 2;
+        }
+        lengths[i] = (size_t)length;
+        position += (size_t)length;
+    }
+    memset(text + position, 'L', TEST_LONG);
+    const int kinds[] = {TABLE_CHAINED, TABLE_SWISS,
+                         TABLE_CHAINED | TABLE_POW2, TABLE_SWISS | TABLE_POW2};
+    for (int k = 0; k < 4; k++)
+    {
+        for (int flags = 0; flags < 4; flags++)
+        {
+            int kind = kinds[k] | (flags & 1 ? TABLE_CONCURRENT : 0) |
+                       (flags & 2 ? TABLE_BORROW : 0);
+            struct table *t = table_init_n(8, 1, hash_wyhash_len, kind);
+            assert(t != NULL);
+            check_bytes(t, text, offsets, lengths, flags & 2);
+            table_cleanup(t);
+            t = table_init_kind(8, 1, hash_function, kind);
+            assert(t != NULL);
+            check_bytes(t, text, offsets, lengths, flags & 2);
+            table_cleanup(t);
+        }
+    }
+    assert(table_init_n(8, 1, NULL, TABLE_CHAINED) == NULL);
+    free(text);
+    free(offsets);
+    free(lengths);
+}
+
+int main(void)
+{
+    test_swiss();
+    test_rehash();
+    test_pow2();
+    test_concurrent();
+    test_merge();
+    test_index();
+    test_bytes();
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,273 @@
+/**
+ * index.c:
+ * Functions in this file build an inverted index of a text file: a hash
+ * table that maps every word to the numbers of the lines it occurs on. The
+ * file is memory mapped and split into one chunk per thread at line
+ * boundaries. Every thread indexes its chunk into a table of its own,
+ * without locks, and the tables are merged shard by shard at the end.
+ *
+*/
+
+/* posix_madvise and sysconf are POSIX, not C99. */
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "array.h"
+#include "hash_table.h"
+
+/* Most threads index_build uses. */
+#define INDEX_MAX_THREADS 256
+
+/* Initial capacity of the table of one thread. */
+#define INDEX_CAPACITY 4096
+
+/**
+ * Struct index_task
+ * @param begin first character of the chunk
+ * @param end character after the last one of the chunk
+ * @param line number of the first line of the chunk
+ * @param lines number of newlines in the chunk
+ * @param t the table the chunk is indexed into
+ * @param result 0 if successfull else 1
+ */
+struct index_task
+{
+    const char *begin;
+    const char *end;
+    int line;
+    int lines;
+    struct table *t;
+    int result;
+};
+
+/* Helper function: Return 1 if c is part of a word: an ASCII letter or
+ * digit, or any byte of a UTF-8 character that is not ASCII. */
+static int word_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/* Helper function: Count the newlines of a chunk, as a thread. */
+static void *count_task_run(void *arg)
+{
+    struct index_task *task = arg;
+    const char *p = task->begin;
+    task->lines = 0;
+    while ((p = memchr(p, '\n', (size_t)(task->end - p))) != NULL)
+    {
+        task->lines++;
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * This function inserts every word of a chunk into the table of the task,
+ * with the number of its line as value, as a thread. The words are hashed
+ * and compared where they are in the file, only a new word is copied.
+ *
+ * @param arg the struct index_task of the chunk
+ * @return NULL
+ */
+static void *index_task_run(void *arg)
+{
+    struct index_task *task = arg;
+    int line = task->line;
+    for (const char *p = task->begin; p < task->end; p++)
+    {
+        if (*p == '\n')
+        {
+            line++;
+            continue;
+        }
+        if (!word_char((unsigned char)*p))
+        {
+            continue;
+        }
+        const char *word = p;
+        while (p < task->end && word_char((unsigned char)*p))
+        {
+            p++;
+        }
+        task->result |=
+            table_insert_n(task->t, word, (size_t)(p - word), line);
+        //! the character after the word is looked at by the loop again
+        p--;
+    }
+    return NULL;
+}
+
+/**
+ * This function runs a function for every task, on a thread per task. The
+ * first task runs on this thread, as does a task that could not get a
+ * thread of its own.
+ *
+ * @param run the function
+ * @param tasks the tasks
+ * @param count number of tasks
+ */
+static void run_tasks(void *(*run)(void *), struct index_task *tasks,
+                      int count)
+{
+    pthread_t thread[INDEX_MAX_THREADS];
+    int forked[INDEX_MAX_THREADS];
+    for (int i = 0; i < count; i++)
+    {
+        forked[i] =
+            i > 0 && pthread_create(&thread[i], NULL, run, &tasks[i]) == 0;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (!forked[i])
+        {
+            run(&tasks[i]);
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (forked[i])
+        {
+            pthread_join(thread[i], NULL);
+        }
+    }
+}
+
+/**
+ * This function builds an inverted index of a text file. A word is a run of
+ * ASCII letters and digits and bytes of UTF-8 characters, it is indexed as
+ * it is written, without changing its case. The index maps every word to
+ * the numbers of the lines it occurs on, counted from 1, once per
+ * occurrence and in increasing order. The file is read through a memory
+ * map and split into one chunk per thread at line boundaries. The newlines
+ * of all chunks are counted first, so every thread knows the number of its
+ * first line, then every thread indexes its chunk into a table of its own,
+ * which needs no locks. At the end the tables are merged into one concurrent
+ * table with table_merge, which moves the nodes of a shard at a time on
+ * every processor.
+ *
+ * @param path the path of the text file
+ * @param threads number of threads to use, the number of processors if it
+ * is 0 or less
+ * @param hash_func_n the function used for computing the hash value, see
+ * table_init_n
+ * @param kind TABLE_CHAINED or TABLE_SWISS, optionally with TABLE_POW2, the
+ * index is made with TABLE_CONCURRENT added to it. TABLE_BORROW is ignored,
+ * the keys would point into the file, which is unmapped at the end
+ * @return a pointer to the index, NULL on failure
+ */
+struct table *index_build(const char *path, int threads,
+                          unsigned long (*hash_func_n)(const void *, size_t),
+                          int kind)
+{
+    //! the words are copied into the index, the map does not outlive it
+    kind &= ~TABLE_BORROW;
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if (threads > INDEX_MAX_THREADS)
+    {
+        threads = INDEX_MAX_THREADS;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    //! an empty file can not be mapped, it has an empty index
+    if (size == 0)
+    {
+        close(fd);
+        return table_init_n(INDEX_CAPACITY, 1, hash_func_n,
+                            kind | TABLE_CONCURRENT);
+    }
+    const char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        return NULL;
+    }
+    posix_madvise((void *)text, size, POSIX_MADV_SEQUENTIAL);
+    //! a small file gets fewer threads, so every chunk has some work
+    if ((size_t)threads > size / 4096 + 1)
+    {
+        threads = (int)(size / 4096 + 1);
+    }
+    //! end every chunk after a newline
+    struct index_task tasks[INDEX_MAX_THREADS];
+    const char *begin = text;
+    for (int i = 0; i < threads; i++)
+    {
+        const char *end = text + size;
+        if (i < threads - 1)
+        {
+            end = text + size / (size_t)threads * (size_t)(i + 1);
+            if (end < begin)
+            {
+                end = begin;
+            }
+            const char *newline =
+                memchr(end, '\n', (size_t)(text + size - end));
+            end = newline == NULL ? text + size : newline + 1;
+        }
+        tasks[i] = (struct index_task){begin, end, 0, 0, NULL, 0};
+        begin = end;
+    }
+    run_tasks(count_task_run, tasks, threads);
+    struct table *index = table_init_n(INDEX_CAPACITY, 1, hash_func_n,
+                                       kind | TABLE_CONCURRENT);
+    int line = 1;
+    int result = index == NULL;
+    for (int i = 0; i < threads; i++)
+    {
+        tasks[i].line = line;
+        line += tasks[i].lines;
+        tasks[i].t = table_init_n(INDEX_CAPACITY, 1, hash_func_n, kind);
+        result |= tasks[i].t == NULL;
+    }
+    if (result == 0)
+    {
+        run_tasks(index_task_run, tasks, threads);
+    }
+    //! merge the tables in the order of the chunks, which keeps the line
+    //! numbers of every word in order
+    for (int i = 0; i < threads; i++)
+    {
+        result |= tasks[i].result;
+        if (index != NULL && tasks[i].t != NULL)
+        {
+            result |= table_merge(index, tasks[i].t);
+        }
+        else if (tasks[i].t != NULL)
+        {
+            table_cleanup(tasks[i].t);
+        }
+    }
+    munmap((void *)text, size);
+    if (result != 0)
+    {
+        if (index != NULL)
+        {
+            table_cleanup(index);
+        }
+        return NULL;
+    }
+    return index;
+}